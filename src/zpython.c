@@ -1,19 +1,39 @@
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE 1
+#endif
 #include "config.h"
 #define MODULE
 #include <zsh/zsh.mdh>
 #undef MODULE
 
 #include <Python.h>
+#include <marshal.h>
+#include <pthread.h>
+#include <dlfcn.h>
 
 #if PY_MAJOR_VERSION >= 3
 # define PyString_Check             PyBytes_Check
 # define PyString_FromString        PyBytes_FromString
 # define PyString_FromStringAndSize PyBytes_FromStringAndSize
 # define PyString_AsStringAndSize   PyBytes_AsStringAndSize
+# define PyString_AS_STRING         PyBytes_AS_STRING
+# define PyString_GET_SIZE          PyBytes_GET_SIZE
+# define EVAL_CODE(code, g, l)      PyEval_EvalCode(code, g, l)
+#else
+# define EVAL_CODE(code, g, l)      PyEval_EvalCode((PyCodeObject *) code, g, l)
 #endif
 
-#define PYTHON_SAVE_THREAD PyGILState_Release(pygilstate)
-#define PYTHON_RESTORE_THREAD pygilstate = PyGILState_Ensure()
+/* Every entry point takes the GIL with its own PyGILState_Ensure state, so 
+ * nested calls (zsh -> Python -> zsh -> Python) restore exactly what they 
+ * found. Main thread does not hold the GIL while zsh runs. */
+#define PYTHON_SAVE_THREAD python_leave(pygilstate)
+#define PYTHON_RESTORE_THREAD PyGILState_STATE pygilstate = python_enter()
+/* Python code running zsh code (which may block or take long) releases the GIL 
+ * around it, nested entry points take it back with python_enter */
+#define ZSH_BEGIN_ALLOW_THREADS \
+    { PyThreadState *zsh_tstate = zsh_allow_threads();
+#define ZSH_END_ALLOW_THREADS \
+    zsh_disallow_threads(zsh_tstate); }
 
 struct specialparam {
     char *name;
@@ -22,9 +42,38 @@ struct specialparam {
     struct specialparam *prev;
 };
 
+/* Caching modes of special parameters: value is kept until it is invalidated 
+ * by zsh.invalidate or assignment, until it is older then ttl seconds or 
+ * until the next precmd. Asynchronous parameters always return the last 
+ * computed value and recompute it in the background thread once per prompt. 
+ * Values of parameters bound to zsh.Cell objects are read from the cell. */
+#define SPECIAL_CACHE_NONE    0
+#define SPECIAL_CACHE_MANUAL  1
+#define SPECIAL_CACHE_TTL     2
+#define SPECIAL_CACHE_PROMPT  3
+#define SPECIAL_CACHE_ASYNC   4
+#define SPECIAL_CELL          5
+
 struct special_data {
     struct specialparam *sp;
     PyObject *obj;
+    int type;
+    int cache;
+    int cached;
+    double ttl;
+    double expires;
+    unsigned long generation;
+    /* For SPECIAL_CACHE_ASYNC: [last value or None, refresh pending] list 
+     * shared with the refresh queue items and the callable to run after 
+     * refresh */
+    PyObject *cell;
+    PyObject *on_update;
+    union {
+	char *str;
+	zlong i;
+	double f;
+	char **arr;
+    } value;
 };
 
 struct obj_hash_node {
@@ -40,23 +89,118 @@ static zlong zpython_subshell;
 static PyObject *hashdict = NULL;
 static struct specialparam *first_assigned_param = NULL;
 static struct specialparam *last_assigned_param = NULL;
-static PyGILState_STATE pygilstate = PyGILState_UNLOCKED;
+/* Thread which loaded the module, number of its entry points that currently 
+ * hold the GIL and its thread state saved while zsh runs */
+static pthread_t main_thread;
+static int main_depth = 0;
+static PyThreadState *main_tstate = NULL;
+/* Number of entry points in which main thread released the GIL to run zsh 
+ * code and its thread state saved there: main thread holds the GIL only while 
+ * main_depth > main_released */
+static int main_released = 0;
+static PyThreadState *released_tstate = NULL;
+/* GIL is held by the main thread outside of entry points: taken by fork 
+ * handler and not yet released in the child */
+static int gil_taken_for_fork = 0;
+/* Writers installed by native-io option and sys module dictionary with keys 
+ * used to check that they are still in place */
+static PyObject *native_stdout = NULL;
+static PyObject *native_stderr = NULL;
+#if PY_MAJOR_VERSION >= 3
+static PyObject *sys_dict = NULL;
+static PyObject *stdout_key = NULL;
+static PyObject *stderr_key = NULL;
+#endif
+/* Incremented by zpython -i which is run from precmd once some parameter uses 
+ * SPECIAL_CACHE_PROMPT */
+static unsigned long special_generation = 0;
+static int prompt_hook_installed = 0;
+#if PY_VERSION_HEX >= 0x03040000
+/* asyncio loop returned by zsh.event_loop */
+static PyObject *event_loop = NULL;
+#endif
+
+
+static PyGILState_STATE
+python_enter(void)
+{
+    PyGILState_STATE state = PyGILState_Ensure();
+
+    if (pthread_equal(pthread_self(), main_thread))
+	main_depth++;
+    return state;
+}
+
+static void
+python_leave(PyGILState_STATE state)
+{
+    if (pthread_equal(pthread_self(), main_thread))
+	main_depth--;
+    PyGILState_Release(state);
+}
 
+static PyThreadState *
+zsh_allow_threads(void)
+{
+    main_released++;
+    return released_tstate = PyEval_SaveThread();
+}
+
+static void
+zsh_disallow_threads(PyThreadState *tstate)
+{
+    PyEval_RestoreThread(tstate);
+    main_released--;
+}
+
+/* zsh is not thread safe: its API may only be used by the main thread while 
+ * it runs Python code from some entry point */
+static int
+check_main_thread(void)
+{
+    if (pthread_equal(pthread_self(), main_thread) && main_depth > 0)
+	return 0;
+    PyErr_SetString(PyExc_RuntimeError,
+	    "zsh may only be used from the main thread while it runs Python code");
+    return -1;
+}
 
+/* Called in the child before it first uses Python. Holds the GIL taken by 
+ * fork handler or by entry point which forked. */
 static void
 after_fork()
 {
     zpython_subshell = zsh_subshell;
     hashdict = NULL;
+#if PY_VERSION_HEX >= 0x03070000
+    PyOS_AfterFork_Child();
+#else
     PyOS_AfterFork();
+#endif
+    if (gil_taken_for_fork) {
+	gil_taken_for_fork = 0;
+	main_tstate = PyEval_SaveThread();
+    }
 }
 
+static int init_python(void);
+static void wait_preload(void);
+static double get_time(void);
+static int run_python_hooks(char *nam, char **args);
+static int run_python_widget(char *nam, char **args);
+static int run_event_loop_once(char *nam, char **args);
+#if PY_VERSION_HEX >= 0x03040000
+static void wake_event_loop(void);
+#endif
+static PyObject *get_hook_timings(void);
+static void install_prompt_hook(void);
+
 #define PYTHON_INIT(failval) \
-    PYTHON_RESTORE_THREAD; \
- \
-    if (zsh_subshell > zpython_subshell) { \
+    if (!Py_IsInitialized() && init_python()) \
+	return failval; \
+    if (zsh_subshell > zpython_subshell) \
 	after_fork(); \
-    }
+    PYTHON_RESTORE_THREAD
 
 #if PY_MAJOR_VERSION >= 3
 static void
@@ -87,6 +231,17 @@ static void
 flush_io()
 {
 #if PY_MAJOR_VERSION >= 3
+    if (native_stdout) {
+	PyObject *err = PyDict_GetItem(sys_dict, stderr_key);
+	PyObject *out = PyDict_GetItem(sys_dict, stdout_key);
+
+	/* Only streams replaced by Python code need flushing */
+	if (err != native_stderr)
+	    run_flush(err);
+	if (out != native_stdout)
+	    run_flush(out);
+	return;
+    }
     run_flush(PySys_GetObject("stderr"));
     run_flush(PySys_GetObject("stdout"));
 #else
@@ -99,490 +254,4975 @@ flush_io()
     flush_io(); \
     PYTHON_SAVE_THREAD
 
-/**/
-static int
-do_zpython(char *nam, char **args, Options ops, int func)
+/* Cache of compiled code objects used by the zpython builtin. Entries are 
+ * found by hash and length of the source text and then compared, least 
+ * recently used entries are evicted once cache holds codecache_capacity 
+ * entries. */
+
+#define CODECACHE_DEFAULT_CAPACITY 64
+
+struct codecache_entry {
+    char *src;
+    size_t len;
+    unsigned hash;
+    PyObject *code;
+    struct codecache_entry *hnext;
+    struct codecache_entry *next;
+    struct codecache_entry *prev;
+};
+
+static struct codecache_entry **codecache_buckets = NULL;
+static size_t codecache_bucket_count = 0;
+static size_t codecache_capacity = CODECACHE_DEFAULT_CAPACITY;
+static size_t codecache_size = 0;
+static struct codecache_entry *codecache_first = NULL;
+static struct codecache_entry *codecache_last = NULL;
+static unsigned long codecache_hits = 0;
+static unsigned long codecache_misses = 0;
+static unsigned long codecache_evictions = 0;
+static int lazy_boot = 0;
+static double init_time = 0.0;
+static PyObject *preload_thread = NULL;
+static PyObject *preload_info = NULL;
+static double preload_wait = 0.0;
+static char *codecache_file = NULL;
+static pid_t codecache_owner = 0;
+
+static void
+codecache_unlink(struct codecache_entry *entry)
 {
-    PyObject *result;
-    int exit_code = 0;
+    if (entry->prev)
+	entry->prev->next = entry->next;
+    else
+	codecache_first = entry->next;
 
-    PYTHON_INIT(2);
+    if (entry->next)
+	entry->next->prev = entry->prev;
+    else
+	codecache_last = entry->prev;
+}
 
-    result = PyRun_String(*args, Py_file_input, globals, globals);
-    if (result == NULL)
-    {
-	if (PyErr_Occurred()) {
-	    PyErr_PrintEx(0);
-	    exit_code = 1;
-	}
-    }
+static void
+codecache_push(struct codecache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = codecache_first;
+    if (codecache_first)
+	codecache_first->prev = entry;
     else
-	Py_DECREF(result);
-    PyErr_Clear();
+	codecache_last = entry;
+    codecache_first = entry;
+}
 
-    PYTHON_FINISH;
-    return exit_code;
+static void
+codecache_free(struct codecache_entry *entry)
+{
+    struct codecache_entry **bucket =
+	&codecache_buckets[entry->hash & (codecache_bucket_count - 1)];
+
+    while (*bucket != entry)
+	bucket = &(*bucket)->hnext;
+    *bucket = entry->hnext;
+
+    codecache_unlink(entry);
+    codecache_size--;
+
+    Py_DECREF(entry->code);
+    zfree(entry->src, entry->len + 1);
+    PyMem_Free(entry);
 }
 
-typedef void *(*Allocator) (size_t);
-typedef void (*DeAllocator) (void *, int);
+static void
+codecache_clear(void)
+{
+    while (codecache_first)
+	codecache_free(codecache_first);
+}
 
-static char *
-get_chars(PyObject *string, Allocator alloc)
+static int
+codecache_init(size_t capacity)
 {
-    char *str, *buf, *bufstart;
-    Py_ssize_t len = 0;
-    Py_ssize_t i = 0;
-    Py_ssize_t buflen = 1;
+    codecache_capacity = capacity;
+    if (!capacity)
+	return 0;
 
-    if (PyString_Check(string)) {
-	if (PyString_AsStringAndSize(string, &str, &len) == -1)
-	    return NULL;
-    }
-    else {
-#if defined(PY_VERSION_HEX) && PY_VERSION_HEX >= 0x03030000
-	if (!(str = PyUnicode_AsUTF8AndSize(string, &len)))
-	    return NULL;
-#else
-	PyObject *bytes;
-	if (!(bytes = PyUnicode_AsUTF8String(string)))
-	    return NULL;
+    codecache_bucket_count = 1;
+    while (codecache_bucket_count < 2 * capacity)
+	codecache_bucket_count <<= 1;
 
-	if (PyString_AsStringAndSize(bytes, &str, &len) == -1) {
-	    Py_DECREF(bytes);
-	    return NULL;
+    if (!(codecache_buckets = PyMem_New(struct codecache_entry *,
+				       codecache_bucket_count)))
+	return 1;
+    memset(codecache_buckets, 0,
+	    codecache_bucket_count * sizeof(struct codecache_entry *));
+    return 0;
+}
+
+static void
+codecache_destroy(void)
+{
+    if (!codecache_buckets)
+	return;
+    codecache_clear();
+    PyMem_Free(codecache_buckets);
+    codecache_buckets = NULL;
+    codecache_bucket_count = 0;
+}
+
+static PyObject *
+codecache_lookup(const char *src, size_t len, unsigned hash)
+{
+    struct codecache_entry *entry;
+
+    for (entry = codecache_buckets[hash & (codecache_bucket_count - 1)];
+	    entry; entry = entry->hnext)
+	if (entry->hash == hash && entry->len == len
+		&& !memcmp(entry->src, src, len)) {
+	    if (entry != codecache_first) {
+		codecache_unlink(entry);
+		codecache_push(entry);
+	    }
+	    return entry->code;
 	}
-	Py_DECREF(bytes);
-#endif
-    }
 
-    while (i < len)
-	buflen += 1 + (imeta(str[i++]) ? 1 : 0);
+    return NULL;
+}
 
-    buf = alloc(buflen * sizeof(char));
-    bufstart = buf;
+static int
+codecache_insert(const char *src, size_t len, unsigned hash, PyObject *code)
+{
+    struct codecache_entry *entry, **bucket;
 
-    while (len) {
-	if (imeta(*str)) {
-	    *buf++ = Meta;
-	    *buf++ = *str ^ 32;
-	}
-	else
-	    *buf++ = *str;
-	str++;
-	len--;
+    if (codecache_lookup(src, len, hash))
+	return 0;
+
+    if (!(entry = PyMem_New(struct codecache_entry, 1))) {
+	PyErr_NoMemory();
+	return 1;
     }
-    *buf = '\0';
 
-    return bufstart;
+    while (codecache_size >= codecache_capacity) {
+	codecache_free(codecache_last);
+	codecache_evictions++;
+    }
+
+    entry->src = ztrdup(src);
+    entry->len = len;
+    entry->hash = hash;
+    entry->code = code;
+    Py_INCREF(code);
+
+    bucket = &codecache_buckets[hash & (codecache_bucket_count - 1)];
+    entry->hnext = *bucket;
+    *bucket = entry;
+    codecache_push(entry);
+    codecache_size++;
+
+    return 0;
 }
 
+/* Returns new reference to the code object compiled from src */
 static PyObject *
-ZshEval(UNUSED(PyObject *self), PyObject *obj)
+get_code(const char *src)
 {
-    char *command;
+    PyObject *code;
+    size_t len;
+    unsigned hash;
 
-    if (!(command = get_chars(obj, PyMem_Malloc)))
-	return NULL;
+    if (!codecache_capacity)
+	return Py_CompileString(src, "<string>", Py_file_input);
 
-    execstring(command, 1, 0, ZPYTHON_COMMAND_NAME);
+    len = strlen(src);
+    hash = hasher(src);
 
-    PyMem_Free(command);
+    if ((code = codecache_lookup(src, len, hash))) {
+	codecache_hits++;
+	Py_INCREF(code);
+	return code;
+    }
+    codecache_misses++;
 
-    Py_RETURN_NONE;
+    if (!(code = Py_CompileString(src, "<string>", Py_file_input)))
+	return NULL;
+
+    if (codecache_insert(src, len, hash, code)) {
+	Py_DECREF(code);
+	return NULL;
+    }
+
+    return code;
 }
 
-static PyObject *
-get_string(const char *s)
+static char *
+read_file(const char *path, size_t *lenp)
 {
-    char *buf, *bufstart;
-    PyObject *r;
-    /* No need in \0 byte at the end since we are using 
-     * PyString_FromStringAndSize */
-    if (!(buf = PyMem_New(char, strlen(s))))
+    FILE *file;
+    struct stat st;
+    char *buf;
+
+    if (!(file = fopen(path, "rb")))
+	return NULL;
+
+    if (fstat(fileno(file), &st) == -1) {
+	fclose(file);
 	return NULL;
-    bufstart = buf;
-    while (*s) {
-	*buf++ = (*s == Meta) ? (*++s ^ 32) : (*s);
-	++s;
     }
-    r = PyString_FromStringAndSize(bufstart, (Py_ssize_t) (buf - bufstart));
-    PyMem_Free(bufstart);
-    return r;
+
+    buf = zalloc(st.st_size + 1);
+    if (fread(buf, 1, st.st_size, file) != (size_t) st.st_size) {
+	zfree(buf, st.st_size + 1);
+	fclose(file);
+	return NULL;
+    }
+    fclose(file);
+
+    buf[st.st_size] = '\0';
+    *lenp = (size_t) st.st_size;
+    return buf;
+}
+
+/* Writes data to the temporary file and renames it to path, so that 
+ * concurrently starting shells never see partially written file */
+static int
+write_file(const char *path, const char *data, size_t len)
+{
+    FILE *file;
+    char *tmp = zalloc(strlen(path) + 32);
+    int failed;
+
+    sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+
+    if (!(file = fopen(tmp, "wb"))) {
+	zfree(tmp, strlen(path) + 32);
+	return 1;
+    }
+    failed = fwrite(data, 1, len, file) != len;
+    failed = (fclose(file) != 0) || failed;
+    if (failed || rename(tmp, path) == -1) {
+	unlink(tmp);
+	failed = 1;
+    }
+
+    zfree(tmp, strlen(path) + 32);
+    return failed;
 }
 
+/* Loads code cache saved by codecache_save. File contains marshalled tuple 
+ * (magic, [(source, code), ...]), entries are ordered from least recently 
+ * used to most recently used one. Files written by other Python versions 
+ * are silently ignored. */
 static void
-scanhashdict(HashNode hn, UNUSED(int flags))
+codecache_load(const char *path)
 {
-    struct value v;
-    PyObject *key, *val;
+    char *buf;
+    size_t buflen;
+    PyObject *data, *entries;
+    Py_ssize_t i;
 
-    if (hashdict == NULL)
+    if (!codecache_capacity || !(buf = read_file(path, &buflen)))
 	return;
 
-    v.pm = (Param) hn;
+    data = PyMarshal_ReadObjectFromString(buf, (Py_ssize_t) buflen);
+    zfree(buf, buflen + 1);
 
-    if (!(key = get_string(v.pm->node.nam))) {
-	hashdict = NULL;
+    if (!data) {
+	PyErr_Clear();
 	return;
     }
 
-    v.isarr = (PM_TYPE(v.pm->node.flags) & (PM_ARRAY|PM_HASHED));
-    v.flags = 0;
-    v.start = 0;
-    v.end = -1;
-    if (!(val = get_string(getstrvalue(&v)))) {
-	hashdict = NULL;
-	Py_DECREF(key);
+    if (!PyTuple_Check(data) || PyTuple_GET_SIZE(data) != 2
+	    || PyLong_AsLong(PyTuple_GET_ITEM(data, 0))
+		!= PyImport_GetMagicNumber()
+	    || !PyList_Check(entries = PyTuple_GET_ITEM(data, 1))) {
+	PyErr_Clear();
+	Py_DECREF(data);
 	return;
     }
 
-    if (PyDict_SetItem(hashdict, key, val) == -1)
-	hashdict = NULL;
+    for (i = 0; i < PyList_GET_SIZE(entries); i++) {
+	PyObject *item = PyList_GET_ITEM(entries, i);
+	char *src;
+	Py_ssize_t len;
+
+	if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2
+		|| !PyCode_Check(PyTuple_GET_ITEM(item, 1))
+		|| !PyString_Check(PyTuple_GET_ITEM(item, 0))
+		|| PyString_AsStringAndSize(PyTuple_GET_ITEM(item, 0),
+		    &src, &len) == -1
+		|| strlen(src) != (size_t) len)
+	    continue;
+
+	if (codecache_insert(src, (size_t) len, hasher(src),
+		    PyTuple_GET_ITEM(item, 1)))
+	    break;
+    }
 
-    Py_DECREF(key);
-    Py_DECREF(val);
+    PyErr_Clear();
+    Py_DECREF(data);
 }
 
-static PyObject *
-get_array(char **ss)
+static int
+codecache_save(const char *path)
 {
-    PyObject *r = PyList_New(arrlen(ss));
-    size_t i = 0;
-    while (*ss) {
-	PyObject *str;
-	if (!(str = get_string(*ss++))) {
-	    Py_DECREF(r);
-	    return NULL;
+    PyObject *entries, *data, *marshalled;
+    struct codecache_entry *entry;
+    char *str;
+    Py_ssize_t len;
+    int r;
+
+    if (!(entries = PyList_New(0)))
+	return 1;
+
+    for (entry = codecache_last; entry; entry = entry->prev) {
+	PyObject *src, *item;
+
+	if (!(src = PyString_FromStringAndSize(entry->src,
+			(Py_ssize_t) entry->len))) {
+	    Py_DECREF(entries);
+	    return 1;
 	}
-	if (PyList_SetItem(r, i++, str) == -1) {
-	    Py_DECREF(r);
-	    return NULL;
+	item = PyTuple_Pack(2, src, entry->code);
+	Py_DECREF(src);
+	if (!item) {
+	    Py_DECREF(entries);
+	    return 1;
 	}
+	if (PyList_Append(entries, item) == -1) {
+	    Py_DECREF(item);
+	    Py_DECREF(entries);
+	    return 1;
+	}
+	Py_DECREF(item);
+    }
+
+    data = Py_BuildValue("(lN)", PyImport_GetMagicNumber(), entries);
+    if (!data)
+	return 1;
+
+    marshalled = PyMarshal_WriteObjectToString(data, Py_MARSHAL_VERSION);
+    Py_DECREF(data);
+    if (!marshalled)
+	return 1;
+
+    if (PyString_AsStringAndSize(marshalled, &str, &len) == -1) {
+	Py_DECREF(marshalled);
+	return 1;
     }
+
+    if ((r = write_file(path, str, (size_t) len)))
+	PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *) path);
+
+    Py_DECREF(marshalled);
     return r;
 }
 
-static PyObject *
-get_hash(HashTable ht)
+static int
+codecache_exit_hook(UNUSED(Hookdef d), UNUSED(void *dummy))
 {
-    PyObject *hd;
+    /* Subshells share the cache file with the parent shell: only the shell 
+     * which loaded the module saves it. */
+    if (!codecache_file || getpid() != codecache_owner)
+	return 0;
 
-    if (ht == NULL) {
-	hd = PyDict_New();
-    } else {
-	if (hashdict) {
-	    PyErr_SetString(PyExc_RuntimeError, "hashdict already used. "
-		    "Do not try to get two hashes simultaneously in "
-		    "separate threads, zsh is not thread-safe");
-	    return NULL;
-	}
+    PYTHON_INIT(0);
 
-	hashdict = PyDict_New();
-	if (hashdict == NULL) {
-	    return NULL;
-	}
-	hd = hashdict;
+    if (codecache_save(codecache_file))
+	PyErr_PrintEx(0);
 
-	scanhashtable(ht, 0, 0, 0, scanhashdict, 0);
-	if (hashdict == NULL) {
-	    Py_DECREF(hd);
-	    return NULL;
-	}
+    PYTHON_FINISH;
+    return 0;
+}
 
-	hashdict = NULL;
-    }
-    return hd;
+/* Code objects compiled from files run by zpython -f. Entry is valid while 
+ * file modification time and size stay the same. If $ZPYTHON_BYTECODE_DIR 
+ * is set compiled code is also saved there so that other shells do not need 
+ * to compile it. */
+
+struct filecode {
+    char *path;
+    time_t mtime;
+    off_t size;
+    PyObject *code;
+    struct filecode *next;
+    struct filecode *prev;
+};
+
+static struct filecode *first_filecode = NULL;
+
+static void
+free_filecode(struct filecode *fc)
+{
+    if (fc->prev)
+	fc->prev->next = fc->next;
+    else
+	first_filecode = fc->next;
+
+    if (fc->next)
+	fc->next->prev = fc->prev;
+
+    zsfree(fc->path);
+    Py_DECREF(fc->code);
+    PyMem_Free(fc);
+}
+
+static struct filecode *
+find_filecode(const char *path)
+{
+    struct filecode *fc;
+
+    for (fc = first_filecode; fc; fc = fc->next)
+	if (!strcmp(fc->path, path))
+	    return fc;
+
+    return NULL;
+}
+
+/* Returns path of the file in $ZPYTHON_BYTECODE_DIR where code compiled 
+ * from the given file is saved or NULL if directory was not configured */
+static char *
+get_bytecode_path(const char *path)
+{
+    char *dir = getsparam("ZPYTHON_BYTECODE_DIR");
+    const char *base = strrchr(path, '/');
+    char *r;
+
+    if (!dir || !*dir)
+	return NULL;
+
+    dir = dupstring(unmeta(dir));
+    base = base ? base + 1 : path;
+    r = zhalloc(strlen(dir) + strlen(base) + 32);
+    sprintf(r, "%s/%s.%08x.zpyc", dir, base, hasher(path));
+    return r;
 }
 
+/* Bytecode file contains marshalled tuple (magic, path, mtime, size, code) */
 static PyObject *
-ZshGetValue(UNUSED(PyObject *self), PyObject *args)
+load_bytecode(const char *path, struct stat *st)
 {
-    char *name;
-    struct value vbuf;
-    Value v;
+    char *cpath, *buf, *str;
+    size_t buflen;
+    Py_ssize_t len;
+    PyObject *data, *code = NULL;
 
-    if (!PyArg_ParseTuple(args, "s", &name))
+    if (!(cpath = get_bytecode_path(path))
+	    || !(buf = read_file(cpath, &buflen)))
 	return NULL;
 
-    if (!isident(name)) {
-	PyErr_SetString(PyExc_KeyError, "Parameter name is not an identifier");
+    data = PyMarshal_ReadObjectFromString(buf, (Py_ssize_t) buflen);
+    zfree(buf, buflen + 1);
+
+    if (!data) {
+	PyErr_Clear();
 	return NULL;
     }
 
-    if (!(v = getvalue(&vbuf, &name, 1))) {
-	PyErr_SetString(PyExc_IndexError, "Failed to find parameter");
-	return NULL;
+    if (PyTuple_Check(data) && PyTuple_GET_SIZE(data) == 5
+	    && PyLong_AsLong(PyTuple_GET_ITEM(data, 0))
+		== PyImport_GetMagicNumber()
+	    && PyString_Check(PyTuple_GET_ITEM(data, 1))
+	    && PyString_AsStringAndSize(PyTuple_GET_ITEM(data, 1),
+		&str, &len) != -1
+	    && !strcmp(str, path)
+	    && PyLong_AsLongLong(PyTuple_GET_ITEM(data, 2))
+		== (long long) st->st_mtime
+	    && PyLong_AsLongLong(PyTuple_GET_ITEM(data, 3))
+		== (long long) st->st_size
+	    && PyCode_Check(PyTuple_GET_ITEM(data, 4))) {
+	code = PyTuple_GET_ITEM(data, 4);
+	Py_INCREF(code);
     }
 
-    switch (PM_TYPE(v->pm->node.flags)) {
-    case PM_HASHED:
-	return get_hash(v->pm->gsu.h->getfn(v->pm));
-    case PM_ARRAY:
-	v->arr = v->pm->gsu.a->getfn(v->pm);
-	if (v->isarr) {
-	    return get_array(v->arr);
-	}
-	else {
-	    char *s;
-	    PyObject *str, *r;
+    PyErr_Clear();
+    Py_DECREF(data);
+    return code;
+}
 
-	    if (v->start < 0)
-		v->start += arrlen(v->arr);
-	    s = (v->start >= arrlen(v->arr) || v->start < 0) ?
-		(char *) "" : v->arr[v->start];
-	    if (!(str = get_string(s)))
-		return NULL;
-	    r = PyList_New(1);
-	    if (PyList_SetItem(r, 0, str) == -1) {
-		Py_DECREF(r);
-		return NULL;
-	    }
-	    return r;
-	}
-    case PM_INTEGER:
-	return PyLong_FromLong((long) v->pm->gsu.i->getfn(v->pm));
-    case PM_EFLOAT:
-    case PM_FFLOAT:
-	return PyFloat_FromDouble(v->pm->gsu.f->getfn(v->pm));
-    case PM_SCALAR:
-	return get_string(v->pm->gsu.s->getfn(v->pm));
-    default:
-	PyErr_SetString(PyExc_SystemError,
-		"Parameter has unknown type; should not happen.");
-	return NULL;
+static void
+save_bytecode(const char *path, struct stat *st, PyObject *code)
+{
+    char *cpath, *str;
+    Py_ssize_t len;
+    PyObject *data, *marshalled;
+
+    if (!(cpath = get_bytecode_path(path)))
+	return;
+
+    if (!(data = Py_BuildValue(
+#if PY_MAJOR_VERSION < 3
+		    "(lsLLO)",
+#else
+		    "(lyLLO)",
+#endif
+		    PyImport_GetMagicNumber(), path,
+		    (long long) st->st_mtime, (long long) st->st_size, code))) {
+	PyErr_Clear();
+	return;
     }
+
+    marshalled = PyMarshal_WriteObjectToString(data, Py_MARSHAL_VERSION);
+    Py_DECREF(data);
+    if (!marshalled) {
+	PyErr_Clear();
+	return;
+    }
+
+    /* Failing to save bytecode only means that it will be compiled again 
+     * next time */
+    if (PyString_AsStringAndSize(marshalled, &str, &len) != -1)
+	write_file(cpath, str, (size_t) len);
+
+    PyErr_Clear();
+    Py_DECREF(marshalled);
 }
 
+/* Returns new reference to the code object compiled from file at the given 
+ * (unmetafied, absolute) path */
 static PyObject *
-ZshExpand(UNUSED(PyObject *self), PyObject *args)
+get_file_code(const char *path)
 {
-    char *str;
-    char *ret;
-    int err;
-    local_list1(list);
-
-    if (!PyArg_ParseTuple(args, "s", &str))
-	return NULL;
-    ret = dupstring(str);
-    err = parsestrnoerr(&ret);
-    if (err) {
-	if (err > 32 && err < 127)
-	    PyErr_Format(PyExc_ValueError, "Parse error near `%c'", err);
-	else
-	    PyErr_Format(PyExc_ValueError, "Parse error near byte 0x%x", err);
+    struct filecode *fc;
+    struct stat st;
+    PyObject *code;
+    char *buf;
+    size_t buflen;
+
+    if (stat(path, &st) == -1) {
+	PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
 	return NULL;
     }
-    singsub(&ret);
-    if (strcmp(ret, nulstring) == 0) {
-	ret = "";
+
+    if ((fc = find_filecode(path))) {
+	if (fc->mtime == st.st_mtime && fc->size == st.st_size) {
+	    Py_INCREF(fc->code);
+	    return fc->code;
+	}
+	free_filecode(fc);
     }
-    if (errflag) {
-	PyErr_SetString(PyExc_RuntimeError, "Expand failed");
-	return NULL;
+
+    if (!(code = load_bytecode(path, &st))) {
+	if (!(buf = read_file(path, &buflen))) {
+	    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+	    return NULL;
+	}
+	code = Py_CompileString(buf, path, Py_file_input);
+	zfree(buf, buflen + 1);
+	if (!code)
+	    return NULL;
+	save_bytecode(path, &st, code);
     }
-    return get_string(ret);
+
+    if (!(fc = PyMem_New(struct filecode, 1))) {
+	Py_DECREF(code);
+	return PyErr_NoMemory();
+    }
+    fc->path = ztrdup(path);
+    fc->mtime = st.st_mtime;
+    fc->size = st.st_size;
+    fc->code = code;
+    Py_INCREF(code);
+    fc->prev = NULL;
+    fc->next = first_filecode;
+    if (first_filecode)
+	first_filecode->prev = fc;
+    first_filecode = fc;
+
+    return code;
 }
 
+/* Returns borrowed reference to the dictionary of the module with the given 
+ * name which is created if needed. __file__ is set to the given path. */
 static PyObject *
-ZshGlob(UNUSED(PyObject *self), PyObject *args)
+get_file_namespace(const char *name, const char *path)
 {
-    char *str, *dup;
-    int list_len, i, err;
-    local_list1(list);
-    LinkNode node, next;
-    PyObject *ret;
+    PyObject *module, *ns, *file;
 
-    if (!PyArg_ParseTuple(args, "s", &str))
+    if (!name || !strcmp(name, "__main__"))
+	ns = globals;
+    else if (!(module = PyImport_AddModule(name))
+	    || !(ns = PyModule_GetDict(module)))
 	return NULL;
-    dup = dupstring(str);
-    tokenize(dup);
-    init_list1(list, dup);
 
-    zglob(&list, firstnode(&list), 0);
-    if (badcshglob == 1) {
-	badcshglob = 0;
-	PyErr_SetString(PyExc_ValueError, "No match");
+#if PY_MAJOR_VERSION >= 3
+    if (!(file = PyUnicode_DecodeFSDefault(path)))
+#else
+    if (!(file = PyString_FromString(path)))
+#endif
 	return NULL;
-    }
-    if (errflag) {
-	PyErr_SetString(PyExc_RuntimeError, "Globbing failed");
+
+    if (PyDict_SetItemString(ns, "__file__", file) == -1) {
+	Py_DECREF(file);
 	return NULL;
     }
-    list_len = 0;
-    for (node = firstnode(&list); node; node = next) {
-	next = nextnode(node);
-	list_len++;
+    Py_DECREF(file);
+
+    return ns;
+}
+
+/**/
+static int
+do_zpython(char *nam, char **args, Options ops, int func)
+{
+    PyObject *code, *result, *ns = globals, *main_file = NULL;
+    int exit_code = 0, run_file = 0;
+
+    if (OPT_ISSET(ops, 'i')) {
+	if (*args) {
+	    zwarnnam(nam, "too many arguments");
+	    return 1;
+	}
+	special_generation++;
+	return 0;
     }
-    ret = PyList_New(list_len);
-    for (i = 0, node = firstnode(&list); i < list_len; node = next, i++) {
-	next = nextnode(node);
-	PyObject *item = get_string((char *) getdata(node));
-	if (item == NULL) {
-	    Py_DECREF(ret);
-	    return NULL;
+    if (OPT_ISSET(ops, 'H'))
+	return run_python_hooks(nam, args);
+    if (OPT_ISSET(ops, 'w'))
+	return run_python_widget(nam, args);
+    if (OPT_ISSET(ops, 'e'))
+	return run_event_loop_once(nam, args);
+    if (!*args) {
+	zwarnnam(nam, "not enough arguments");
+	return 1;
+    }
+    if (args[1] && (!OPT_ISSET(ops, 'f') || args[2])) {
+	zwarnnam(nam, "too many arguments");
+	return 1;
+    }
+
+    PYTHON_INIT(2);
+
+    if (preload_thread)
+	wait_preload();
+
+    if (OPT_ISSET(ops, 'f')) {
+	char *path = dupstring(unmeta(args[0]));
+
+	if (*path != '/' && pwd)
+	    path = zhtricat(unmeta(pwd), "/", path);
+
+	/* __file__ set in __main__ is restored after file is run */
+	if ((main_file = PyDict_GetItemString(globals, "__file__")))
+	    Py_INCREF(main_file);
+	run_file = 1;
+
+	if ((code = get_file_code(path))
+		&& !(ns = get_file_namespace(args[1] ? unmeta(args[1]) : NULL,
+			path))) {
+	    Py_DECREF(code);
+	    code = NULL;
 	}
-	PyList_SET_ITEM(ret, i, item);
     }
-    return ret;
+    else
+	code = get_code(*args);
+
+    if (!code)
+	result = NULL;
+    else {
+	result = EVAL_CODE(code, ns, ns);
+	Py_DECREF(code);
+    }
+    if (result == NULL)
+    {
+	if (PyErr_Occurred()) {
+	    PyErr_PrintEx(0);
+	    exit_code = 1;
+	}
+    }
+    else
+	Py_DECREF(result);
+    PyErr_Clear();
+
+    if (run_file && ns == globals) {
+	if (main_file)
+	    PyDict_SetItemString(globals, "__file__", main_file);
+	else
+	    PyDict_DelItemString(globals, "__file__");
+	PyErr_Clear();
+    }
+    Py_XDECREF(main_file);
+
+#if PY_VERSION_HEX >= 0x03040000
+    /* Let zle run loop callbacks scheduled by the code */
+    if (event_loop)
+	wake_event_loop();
+#endif
+
+    PYTHON_FINISH;
+    return exit_code;
 }
 
-#define FAIL_SETTING_ARRAY(val, arrlen, dealloc) \
-	if (dealloc != NULL) { \
-	    while (val-- > valstart) \
-		dealloc(*val, strlen(*val)); \
-	    dealloc(valstart, arrlen); \
-	} \
-	return NULL
+/* Kernels converting between metafied zsh strings and raw bytes. Metafiable 
+ * bytes are stored as Meta followed by byte ^ 32. Vectorized kernels assume 
+ * that metafiable bytes are 0 and Meta..Marker, which is checked before they 
+ * are used. */
 
-#define IS_PY_STRING(s) (PyString_Check(s) || PyUnicode_Check(s))
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+# define META_SIMD
+# include <immintrin.h>
+#endif
 
-static char **
-get_chars_array(PyObject *seq, Allocator alloc, DeAllocator dealloc)
+#define META_FIRST ((unsigned char) 0x83)
+#define META_LAST  ((unsigned char) 0xa2)
+
+struct meta_kernel {
+    const char *name;
+    /* Number of Meta bytes in metafied string */
+    size_t (*count_meta)(const char *s, size_t len);
+    /* Number of bytes that need to be escaped in raw string */
+    size_t (*count_metafiable)(const char *s, size_t len);
+    /* Write unmetafied s to dst, return end of the written data */
+    char *(*unmeta)(char *dst, const char *s, size_t len);
+    /* Write metafied s to dst, return end of the written data */
+    char *(*meta)(char *dst, const char *s, size_t len);
+};
+
+static size_t
+count_meta_scalar(const char *s, size_t len)
 {
-    char **val, **valstart;
-    Py_ssize_t len = PySequence_Size(seq);
-    Py_ssize_t arrlen;
-    Py_ssize_t i = 0;
+    size_t n = 0;
 
-    if (len == -1) {
-	PyErr_SetString(PyExc_ValueError, "Failed to get sequence size");
-	return NULL;
-    }
+    while (len--)
+	n += (*s++ == Meta);
+    return n;
+}
 
-    arrlen = (len + 1) * sizeof(char *);
-    val = (char **) alloc(arrlen);
-    valstart = val;
+static size_t
+count_metafiable_scalar(const char *s, size_t len)
+{
+    size_t n = 0;
 
-    while (i < len) {
-	PyObject *item = PySequence_GetItem(seq, i);
+    while (len--)
+	n += (imeta(*s++) ? 1 : 0);
+    return n;
+}
 
-	if (!IS_PY_STRING(item)) {
-	    PyErr_SetString(PyExc_TypeError, "Sequence item is not a string");
-	    FAIL_SETTING_ARRAY(val, arrlen, dealloc);
-	}
+/* Trailing Meta without the escaped byte is dropped, so the result length is 
+ * always len - count_meta(s, len) */
+static char *
+unmeta_scalar(char *dst, const char *s, size_t len)
+{
+    const char *e = s + len;
 
-	if (!(*val++ = get_chars(item, alloc))) {
-	    FAIL_SETTING_ARRAY(val, arrlen, dealloc);
+    while (s < e) {
+	if (*s == Meta) {
+	    if (++s == e)
+		break;
+	    *dst++ = *s++ ^ 32;
 	}
-	i++;
+	else
+	    *dst++ = *s++;
     }
-    *val = NULL;
+    return dst;
+}
 
-    return valstart;
+static char *
+meta_scalar(char *dst, const char *s, size_t len)
+{
+    while (len--) {
+	if (imeta(*s)) {
+	    *dst++ = Meta;
+	    *dst++ = *s ^ 32;
+	}
+	else
+	    *dst++ = *s;
+	s++;
+    }
+    return dst;
 }
 
-static PyObject *
-ZshSetValue(UNUSED(PyObject *self), PyObject *args)
+#ifdef META_SIMD
+/* Unsigned range check is done by shifting range start to -128 and using 
+ * signed comparison */
+__attribute__((target("sse2")))
+static inline __m128i
+metafiable_sse2(__m128i v)
 {
-    char *name;
-    PyObject *value;
+    __m128i t = _mm_xor_si128(_mm_sub_epi8(v, _mm_set1_epi8((char) META_FIRST)),
+	    _mm_set1_epi8((char) 0x80));
+    __m128i range = _mm_cmplt_epi8(t,
+	    _mm_set1_epi8((char) (0x80 + META_LAST - META_FIRST + 1)));
 
-    if (!PyArg_ParseTuple(args, "sO", &name, &value))
-	return NULL;
+    return _mm_or_si128(range, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+}
 
-    if (!isident(name)) {
-	PyErr_SetString(PyExc_KeyError, "Parameter name is not an identifier");
-	return NULL;
-    }
+__attribute__((target("sse2")))
+static size_t
+count_meta_sse2(const char *s, size_t len)
+{
+    const __m128i meta = _mm_set1_epi8(Meta);
+    size_t n = 0;
 
-    if (IS_PY_STRING(value)) {
-	char *s;
+    for (; len >= 16; s += 16, len -= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) s);
+	n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, meta)));
+    }
+    return n + count_meta_scalar(s, len);
+}
 
-	if (!(s = get_chars(value, zalloc)))
-	    return NULL;
+__attribute__((target("sse2")))
+static size_t
+count_metafiable_sse2(const char *s, size_t len)
+{
+    size_t n = 0;
 
-	if (!setsparam(name, s)) {
-	    PyErr_SetString(PyExc_RuntimeError,
-		    "Failed to assign string to the parameter");
-	    zsfree(s);
-	    return NULL;
-	}
+    for (; len >= 16; s += 16, len -= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) s);
+	n += __builtin_popcount(_mm_movemask_epi8(metafiable_sse2(v)));
     }
-#if PY_MAJOR_VERSION < 3
-    else if (PyInt_Check(value)) {
-	if (!setiparam(name, (zlong) PyInt_AsLong(value))) {
-	    PyErr_SetString(PyExc_RuntimeError,
-		    "Failed to assign integer parameter");
-	    return NULL;
+    return n + count_metafiable_scalar(s, len);
+}
+
+/* Blocks without bytes of interest are copied as a whole, otherwise bytes up 
+ * to the first one are copied and it is converted. Destination is only 
+ * written up to its final length. */
+__attribute__((target("sse2")))
+static char *
+unmeta_sse2(char *dst, const char *s, size_t len)
+{
+    const __m128i meta = _mm_set1_epi8(Meta);
+    const char *e = s + len;
+
+    while (e - s >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) s);
+	unsigned m = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, meta));
+	unsigned k;
+
+	if (!m) {
+	    _mm_storeu_si128((__m128i *) dst, v);
+	    dst += 16;
+	    s += 16;
+	    continue;
 	}
+	k = __builtin_ctz(m);
+	memcpy(dst, s, k);
+	dst += k;
+	s += k + 1;
+	if (s == e)
+	    return dst;
+	*dst++ = *s++ ^ 32;
     }
-#endif
-    else if (PyLong_Check(value)) {
-	if (!setiparam(name, (zlong) PyLong_AsLong(value))) {
-	    PyErr_SetString(PyExc_RuntimeError,
-		    "Failed to assign long parameter");
-	    return NULL;
+    return unmeta_scalar(dst, s, e - s);
+}
+
+__attribute__((target("sse2")))
+static char *
+meta_sse2(char *dst, const char *s, size_t len)
+{
+    const char *e = s + len;
+
+    while (e - s >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) s);
+	unsigned m = (unsigned) _mm_movemask_epi8(metafiable_sse2(v));
+	unsigned k;
+
+	if (!m) {
+	    _mm_storeu_si128((__m128i *) dst, v);
+	    dst += 16;
+	    s += 16;
+	    continue;
 	}
+	k = __builtin_ctz(m);
+	memcpy(dst, s, k);
+	dst += k;
+	s += k;
+	*dst++ = Meta;
+	*dst++ = *s++ ^ 32;
     }
-    else if (PyFloat_Check(value)) {
-	mnumber mnval;
-	mnval.type = MN_FLOAT;
-	mnval.u.d = PyFloat_AsDouble(value);
-	if (!setnparam(name, mnval)) {
-	    PyErr_SetString(PyExc_RuntimeError,
+    return meta_scalar(dst, s, e - s);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+metafiable_avx2(__m256i v)
+{
+    __m256i t = _mm256_xor_si256(
+	    _mm256_sub_epi8(v, _mm256_set1_epi8((char) META_FIRST)),
+	    _mm256_set1_epi8((char) 0x80));
+    __m256i range = _mm256_cmpgt_epi8(
+	    _mm256_set1_epi8((char) (0x80 + META_LAST - META_FIRST + 1)), t);
+
+    return _mm256_or_si256(range, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+static size_t
+count_meta_avx2(const char *s, size_t len)
+{
+    const __m256i meta = _mm256_set1_epi8(Meta);
+    size_t n = 0;
+
+    for (; len >= 32; s += 32, len -= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) s);
+	n += __builtin_popcount(
+		(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, meta)));
+    }
+    return n + count_meta_sse2(s, len);
+}
+
+__attribute__((target("avx2")))
+static size_t
+count_metafiable_avx2(const char *s, size_t len)
+{
+    size_t n = 0;
+
+    for (; len >= 32; s += 32, len -= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) s);
+	n += __builtin_popcount(
+		(unsigned) _mm256_movemask_epi8(metafiable_avx2(v)));
+    }
+    return n + count_metafiable_sse2(s, len);
+}
+
+__attribute__((target("avx2")))
+static char *
+unmeta_avx2(char *dst, const char *s, size_t len)
+{
+    const __m256i meta = _mm256_set1_epi8(Meta);
+    const char *e = s + len;
+
+    while (e - s >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) s);
+	unsigned m = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, meta));
+	unsigned k;
+
+	if (!m) {
+	    _mm256_storeu_si256((__m256i *) dst, v);
+	    dst += 32;
+	    s += 32;
+	    continue;
+	}
+	k = __builtin_ctz(m);
+	memcpy(dst, s, k);
+	dst += k;
+	s += k + 1;
+	if (s == e)
+	    return dst;
+	*dst++ = *s++ ^ 32;
+    }
+    return unmeta_sse2(dst, s, e - s);
+}
+
+__attribute__((target("avx2")))
+static char *
+meta_avx2(char *dst, const char *s, size_t len)
+{
+    const char *e = s + len;
+
+    while (e - s >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) s);
+	unsigned m = (unsigned) _mm256_movemask_epi8(metafiable_avx2(v));
+	unsigned k;
+
+	if (!m) {
+	    _mm256_storeu_si256((__m256i *) dst, v);
+	    dst += 32;
+	    s += 32;
+	    continue;
+	}
+	k = __builtin_ctz(m);
+	memcpy(dst, s, k);
+	dst += k;
+	s += k;
+	*dst++ = Meta;
+	*dst++ = *s++ ^ 32;
+    }
+    return meta_sse2(dst, s, e - s);
+}
+#endif
+
+static const struct meta_kernel meta_kernels[] = {
+    {"scalar", count_meta_scalar, count_metafiable_scalar,
+	unmeta_scalar, meta_scalar},
+#ifdef META_SIMD
+    {"sse2", count_meta_sse2, count_metafiable_sse2, unmeta_sse2, meta_sse2},
+    {"avx2", count_meta_avx2, count_metafiable_avx2, unmeta_avx2, meta_avx2},
+#endif
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static const struct meta_kernel *meta_kernel = NULL;
+
+static int
+meta_kernel_supported(const struct meta_kernel *kernel)
+{
+    int c;
+
+    if (kernel == meta_kernels)
+	return 1;
+
+    for (c = 0; c < 256; c++)
+	if (!imeta(c) != !(c == 0 || (c >= META_FIRST && c <= META_LAST)))
+	    return 0;
+
+#ifdef META_SIMD
+    __builtin_cpu_init();
+    if (!strcmp(kernel->name, "sse2"))
+	return __builtin_cpu_supports("sse2");
+    if (!strcmp(kernel->name, "avx2"))
+	return __builtin_cpu_supports("avx2");
+#endif
+    return 0;
+}
+
+/* Returns the last supported kernel from meta_kernels, they are ordered from 
+ * the slowest to the fastest one */
+static const struct meta_kernel *
+get_meta_kernel(void)
+{
+    if (!meta_kernel) {
+	const struct meta_kernel *kernel;
+
+	for (kernel = meta_kernels; kernel->name; kernel++)
+	    if (meta_kernel_supported(kernel))
+		meta_kernel = kernel;
+    }
+    return meta_kernel;
+}
+
+typedef void *(*Allocator) (size_t);
+typedef void (*DeAllocator) (void *, int);
+
+static char *
+get_chars(PyObject *string, Allocator alloc)
+{
+    const struct meta_kernel *kernel = get_meta_kernel();
+    char *str, *buf;
+    Py_ssize_t len = 0;
+    Py_ssize_t buflen;
+
+    if (PyString_Check(string)) {
+	if (PyString_AsStringAndSize(string, &str, &len) == -1)
+	    return NULL;
+    }
+    else {
+#if defined(PY_VERSION_HEX) && PY_VERSION_HEX >= 0x03030000
+	if (!(str = PyUnicode_AsUTF8AndSize(string, &len)))
+	    return NULL;
+#else
+	PyObject *bytes;
+	if (!(bytes = PyUnicode_AsUTF8String(string)))
+	    return NULL;
+
+	if (PyString_AsStringAndSize(bytes, &str, &len) == -1) {
+	    Py_DECREF(bytes);
+	    return NULL;
+	}
+	Py_DECREF(bytes);
+#endif
+    }
+
+    buflen = len + kernel->count_metafiable(str, len) + 1;
+    buf = alloc(buflen * sizeof(char));
+    *kernel->meta(buf, str, len) = '\0';
+
+    return buf;
+}
+
+static PyObject *
+ZshEval(UNUSED(PyObject *self), PyObject *obj)
+{
+    char *command;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!(command = get_chars(obj, PyMem_Malloc)))
+	return NULL;
+
+    ZSH_BEGIN_ALLOW_THREADS
+    execstring(command, 1, 0, ZPYTHON_COMMAND_NAME);
+    ZSH_END_ALLOW_THREADS
+
+    PyMem_Free(command);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+get_string(const char *s)
+{
+    const struct meta_kernel *kernel = get_meta_kernel();
+    PyObject *r;
+    size_t len = strlen(s), nmeta;
+
+    /* Most strings contain no Meta bytes: create object directly from zsh 
+     * buffer */
+    if (!(nmeta = kernel->count_meta(s, len)))
+	return PyString_FromStringAndSize(s, (Py_ssize_t) len);
+
+    /* Otherwise unmetafy directly into the storage of the new object */
+    if (!(r = PyString_FromStringAndSize(NULL, (Py_ssize_t) (len - nmeta))))
+	return NULL;
+    kernel->unmeta(PyString_AS_STRING(r), s, len);
+    return r;
+}
+
+/* Returns value of hash element as string object */
+static PyObject *
+get_element_string(Param pm)
+{
+    struct value v;
+
+    v.pm = pm;
+    v.isarr = (PM_TYPE(pm->node.flags) & (PM_ARRAY|PM_HASHED));
+    v.flags = 0;
+    v.start = 0;
+    v.end = -1;
+    return get_string(getstrvalue(&v));
+}
+
+static void
+scanhashdict(HashNode hn, UNUSED(int flags))
+{
+    PyObject *key, *val;
+
+    if (hashdict == NULL)
+	return;
+
+    if (!(key = get_string(hn->nam))) {
+	hashdict = NULL;
+	return;
+    }
+
+    if (!(val = get_element_string((Param) hn))) {
+	hashdict = NULL;
+	Py_DECREF(key);
+	return;
+    }
+
+    if (PyDict_SetItem(hashdict, key, val) == -1)
+	hashdict = NULL;
+
+    Py_DECREF(key);
+    Py_DECREF(val);
+}
+
+static PyObject *
+get_array(char **ss)
+{
+    PyObject *r = PyList_New(arrlen(ss));
+    size_t i = 0;
+    while (*ss) {
+	PyObject *str;
+	if (!(str = get_string(*ss++))) {
+	    Py_DECREF(r);
+	    return NULL;
+	}
+	if (PyList_SetItem(r, i++, str) == -1) {
+	    Py_DECREF(r);
+	    return NULL;
+	}
+    }
+    return r;
+}
+
+static PyObject *
+get_hash(HashTable ht)
+{
+    PyObject *hd, *outer;
+
+    if (ht == NULL)
+	return PyDict_New();
+
+    /* Element count of special hashes is not known until they are scanned */
+    if (!(hd = _PyDict_NewPresized(ht->scantab ? 0 : ht->ct)))
+	return NULL;
+
+    /* Scan function of special hash may run Python code getting another 
+     * hash: outer target is restored when inner scan finishes */
+    outer = hashdict;
+    hashdict = hd;
+    scanhashtable(ht, 0, 0, 0, scanhashdict, 0);
+    if (hashdict == NULL) {
+	hashdict = outer;
+	Py_DECREF(hd);
+	return NULL;
+    }
+    hashdict = outer;
+    return hd;
+}
+
+static PyObject *
+get_param_value(char *name)
+{
+    struct value vbuf;
+    Value v;
+
+    if (!isident(name)) {
+	PyErr_SetString(PyExc_KeyError, "Parameter name is not an identifier");
+	return NULL;
+    }
+
+    if (!(v = getvalue(&vbuf, &name, 1))) {
+	PyErr_SetString(PyExc_IndexError, "Failed to find parameter");
+	return NULL;
+    }
+
+    switch (PM_TYPE(v->pm->node.flags)) {
+    case PM_HASHED:
+	return get_hash(v->pm->gsu.h->getfn(v->pm));
+    case PM_ARRAY:
+	v->arr = v->pm->gsu.a->getfn(v->pm);
+	if (v->isarr) {
+	    return get_array(v->arr);
+	}
+	else {
+	    char *s;
+	    PyObject *str, *r;
+
+	    if (v->start < 0)
+		v->start += arrlen(v->arr);
+	    s = (v->start >= arrlen(v->arr) || v->start < 0) ?
+		(char *) "" : v->arr[v->start];
+	    if (!(str = get_string(s)))
+		return NULL;
+	    r = PyList_New(1);
+	    if (PyList_SetItem(r, 0, str) == -1) {
+		Py_DECREF(r);
+		return NULL;
+	    }
+	    return r;
+	}
+    case PM_INTEGER:
+	return PyLong_FromLong((long) v->pm->gsu.i->getfn(v->pm));
+    case PM_EFLOAT:
+    case PM_FFLOAT:
+	return PyFloat_FromDouble(v->pm->gsu.f->getfn(v->pm));
+    case PM_SCALAR:
+	return get_string(v->pm->gsu.s->getfn(v->pm));
+    default:
+	PyErr_SetString(PyExc_SystemError,
+		"Parameter has unknown type; should not happen.");
+	return NULL;
+    }
+}
+
+static PyObject *
+ZshGetValue(UNUSED(PyObject *self), PyObject *args)
+{
+    char *name;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+	return NULL;
+
+    return get_param_value(name);
+}
+
+/* Batched functions do not stop on the first failing parameter: they save 
+ * exception type of the first error, collect names of all failed parameters 
+ * and raise one exception listing them at the end. */
+struct batch_error {
+    PyObject *type;
+    char *names;
+};
+
+static void
+batch_error_add(struct batch_error *err, char *name)
+{
+    if (!err->type) {
+	PyObject *value, *tb;
+
+	PyErr_Fetch(&err->type, &value, &tb);
+	Py_XDECREF(value);
+	Py_XDECREF(tb);
+	err->names = dupstring(name);
+    }
+    else {
+	PyErr_Clear();
+	err->names = zhtricat(err->names, ", ", name);
+    }
+}
+
+static int
+batch_error_raise(struct batch_error *err, const char *action)
+{
+    if (!err->type)
+	return 0;
+
+    PyErr_Format(err->type, "Failed to %s: %s", action, err->names);
+    Py_DECREF(err->type);
+    err->type = NULL;
+    return -1;
+}
+
+static PyObject *
+ZshGetValues(UNUSED(PyObject *self), PyObject *names)
+{
+    PyObject *iter, *item, *r;
+    struct batch_error err = {NULL, NULL};
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!(iter = PyObject_GetIter(names)))
+	return NULL;
+
+    if (!(r = PyDict_New())) {
+	Py_DECREF(iter);
+	return NULL;
+    }
+
+    while ((item = PyIter_Next(iter))) {
+	char *name;
+	PyObject *value;
+
+	if (!PyArg_Parse(item, "s", &name)) {
+	    Py_DECREF(item);
+	    break;
+	}
+
+	if (!(value = get_param_value(name)))
+	    batch_error_add(&err, name);
+	else {
+	    if (PyDict_SetItem(r, item, value) == -1) {
+		Py_DECREF(value);
+		Py_DECREF(item);
+		break;
+	    }
+	    Py_DECREF(value);
+	}
+	Py_DECREF(item);
+    }
+    Py_DECREF(iter);
+
+    if (PyErr_Occurred()) {
+	Py_XDECREF(err.type);
+	Py_DECREF(r);
+	return NULL;
+    }
+    if (batch_error_raise(&err, "get parameters")) {
+	Py_DECREF(r);
+	return NULL;
+    }
+
+    return r;
+}
+
+static PyObject *
+ZshExpand(UNUSED(PyObject *self), PyObject *args)
+{
+    char *str;
+    char *ret;
+    int err;
+    local_list1(list);
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTuple(args, "s", &str))
+	return NULL;
+    ret = dupstring(str);
+    err = parsestrnoerr(&ret);
+    if (err) {
+	if (err > 32 && err < 127)
+	    PyErr_Format(PyExc_ValueError, "Parse error near `%c'", err);
+	else
+	    PyErr_Format(PyExc_ValueError, "Parse error near byte 0x%x", err);
+	return NULL;
+    }
+    ZSH_BEGIN_ALLOW_THREADS
+    singsub(&ret);
+    ZSH_END_ALLOW_THREADS
+    if (strcmp(ret, nulstring) == 0) {
+	ret = "";
+    }
+    if (errflag) {
+	PyErr_SetString(PyExc_RuntimeError, "Expand failed");
+	return NULL;
+    }
+    return get_string(ret);
+}
+
+static int
+check_glob_errors(void)
+{
+    if (badcshglob == 1) {
+	badcshglob = 0;
+	PyErr_SetString(PyExc_ValueError, "No match");
+	return -1;
+    }
+    if (errflag) {
+	PyErr_SetString(PyExc_RuntimeError, "Globbing failed");
+	return -1;
+    }
+    return 0;
+}
+
+/* Iterator over matches copied out of zsh heap into one block, converted to 
+ * Python strings one at a time */
+typedef struct {
+    PyObject_HEAD
+    char **matches;
+    Py_ssize_t count;
+    Py_ssize_t pos;
+} GlobIterObject;
+
+static PyTypeObject GlobIterType;
+
+static PyObject *
+GlobIterNext(GlobIterObject *self)
+{
+    if (self->pos >= self->count)
+	return NULL;
+    return get_string(self->matches[self->pos++]);
+}
+
+static PyObject *
+GlobIterIter(PyObject *self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static void
+GlobIterDealloc(GlobIterObject *self)
+{
+    PyMem_Free(self->matches);
+    PyObject_Del(self);
+}
+
+static PyObject *
+ZshIGlob(UNUSED(PyObject *self), PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"pattern", "limit", NULL};
+    char *str, *dup, *p;
+    PyObject *limitobj = Py_None;
+    long limit = -1;
+    size_t size;
+    Py_ssize_t count;
+    local_list1(list);
+    LinkNode node;
+    GlobIterObject *iter;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|O", kwlist,
+		&str, &limitobj))
+	return NULL;
+    if (limitobj != Py_None) {
+	if ((limit = PyLong_AsLong(limitobj)) == -1 && PyErr_Occurred())
+	    return NULL;
+	if (limit < 0) {
+	    PyErr_SetString(PyExc_ValueError, "limit must not be negative");
+	    return NULL;
+	}
+    }
+
+    dup = zhalloc(strlen(str) + 32);
+    strcpy(dup, str);
+    /* Y qualifier makes zglob stop walking directories after limit matches. 
+     * Qualifiers can only be chained with #q syntax; otherwise pattern which 
+     * may already end with qualifiers is only cut after globbing. */
+    if (limit > 0) {
+	if (isset(EXTENDEDGLOB))
+	    sprintf(dup + strlen(dup), "(#qY%ld)", limit);
+	else if (isset(BAREGLOBQUAL) && (!*str || str[strlen(str) - 1] != ')'))
+	    sprintf(dup + strlen(dup), "(Y%ld)", limit);
+    }
+    tokenize(dup);
+    init_list1(list, dup);
+
+    if (limit != 0) {
+	ZSH_BEGIN_ALLOW_THREADS
+	zglob(&list, firstnode(&list), 0);
+	ZSH_END_ALLOW_THREADS
+	if (check_glob_errors())
+	    return NULL;
+    }
+
+    count = 0;
+    size = 0;
+    for (node = limit ? firstnode(&list) : NULL;
+	    node && (limit < 0 || count < limit); node = nextnode(node)) {
+	count++;
+	size += strlen((char *) getdata(node)) + 1;
+    }
+
+    if (!(iter = PyObject_NEW(GlobIterObject, &GlobIterType)))
+	return NULL;
+    iter->count = count;
+    iter->pos = 0;
+    if (!(iter->matches = PyMem_Malloc(count * sizeof(char *) + size + 1))) {
+	iter->count = 0;
+	Py_DECREF(iter);
+	return PyErr_NoMemory();
+    }
+    p = (char *) (iter->matches + count);
+    for (count = 0, node = firstnode(&list); count < iter->count;
+	    count++, node = nextnode(node)) {
+	iter->matches[count] = p;
+	strcpy(p, (char *) getdata(node));
+	p += strlen(p) + 1;
+    }
+    return (PyObject *) iter;
+}
+
+/* Returns new reference to the list of matches of pattern */
+static PyObject *
+glob_list(char *str)
+{
+    char *dup;
+    int list_len, i;
+    local_list1(list);
+    LinkNode node, next;
+    PyObject *ret;
+
+    dup = dupstring(str);
+    tokenize(dup);
+    init_list1(list, dup);
+
+    ZSH_BEGIN_ALLOW_THREADS
+    zglob(&list, firstnode(&list), 0);
+    ZSH_END_ALLOW_THREADS
+    if (check_glob_errors())
+	return NULL;
+    list_len = 0;
+    for (node = firstnode(&list); node; node = next) {
+	next = nextnode(node);
+	list_len++;
+    }
+    ret = PyList_New(list_len);
+    for (i = 0, node = firstnode(&list); i < list_len; node = next, i++) {
+	next = nextnode(node);
+	PyObject *item = get_string((char *) getdata(node));
+	if (item == NULL) {
+	    Py_DECREF(ret);
+	    return NULL;
+	}
+	PyList_SET_ITEM(ret, i, item);
+    }
+    return ret;
+}
+
+static PyObject *
+ZshGlob(UNUSED(PyObject *self), PyObject *args)
+{
+    char *str;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTuple(args, "s", &str))
+	return NULL;
+    return glob_list(str);
+}
+
+/* Match of zsh.glob_stat: stat data is kept in C, objects for path and fields 
+ * are made when accessed */
+typedef struct {
+    PyObject_HEAD
+    char *path;
+    PyObject *pathobj;
+    struct stat st;
+} GlobEntryObject;
+
+static PyTypeObject GlobEntryType;
+
+static PyObject *
+GlobEntryGetPath(GlobEntryObject *self, UNUSED(void *closure))
+{
+    if (!self->pathobj && !(self->pathobj = get_string(self->path)))
+	return NULL;
+    Py_INCREF(self->pathobj);
+    return self->pathobj;
+}
+
+static PyObject *
+GlobEntryGetSize(GlobEntryObject *self, UNUSED(void *closure))
+{
+    return PyLong_FromLongLong((long long) self->st.st_size);
+}
+
+static PyObject *
+GlobEntryGetMode(GlobEntryObject *self, UNUSED(void *closure))
+{
+    return PyLong_FromLong((long) self->st.st_mode);
+}
+
+static PyObject *
+GlobEntryGetMtime(GlobEntryObject *self, UNUSED(void *closure))
+{
+    double mtime = (double) self->st.st_mtime;
+
+#ifdef GET_ST_MTIME_NS
+    mtime += GET_ST_MTIME_NS(self->st) / 1e9;
+#endif
+    return PyFloat_FromDouble(mtime);
+}
+
+static PyObject *
+GlobEntryGetType(GlobEntryObject *self, UNUSED(void *closure))
+{
+    const char *type;
+
+    if (S_ISREG(self->st.st_mode))
+	type = "file";
+    else if (S_ISDIR(self->st.st_mode))
+	type = "directory";
+    else if (S_ISLNK(self->st.st_mode))
+	type = "link";
+    else if (S_ISFIFO(self->st.st_mode))
+	type = "fifo";
+    else if (S_ISSOCK(self->st.st_mode))
+	type = "socket";
+    else if (S_ISCHR(self->st.st_mode))
+	type = "char";
+    else if (S_ISBLK(self->st.st_mode))
+	type = "block";
+    else
+	type = "unknown";
+    return Py_BuildValue("s", type);
+}
+
+static PyObject *
+GlobEntryRepr(GlobEntryObject *self)
+{
+    PyObject *path, *pathrepr, *r;
+
+    if (!(path = GlobEntryGetPath(self, NULL)))
+	return NULL;
+    pathrepr = PyObject_Repr(path);
+    Py_DECREF(path);
+    if (!pathrepr)
+	return NULL;
+#if PY_MAJOR_VERSION >= 3
+    r = PyUnicode_FromFormat("<zsh.GlobEntry %U>", pathrepr);
+#else
+    r = PyString_FromFormat("<zsh.GlobEntry %s>",
+	    PyString_AS_STRING(pathrepr));
+#endif
+    Py_DECREF(pathrepr);
+    return r;
+}
+
+static void
+GlobEntryDealloc(GlobEntryObject *self)
+{
+    Py_XDECREF(self->pathobj);
+    PyMem_Free(self->path);
+    PyObject_Del(self);
+}
+
+static PyGetSetDef GlobEntryGetSet[] = {
+    {"path", (getter) GlobEntryGetPath, NULL, "Matched path", NULL},
+    {"size", (getter) GlobEntryGetSize, NULL, "Size in bytes", NULL},
+    {"mode", (getter) GlobEntryGetMode, NULL, "st_mode of the file", NULL},
+    {"mtime", (getter) GlobEntryGetMtime, NULL,
+	"Modification time in seconds since the epoch", NULL},
+    {"type", (getter) GlobEntryGetType, NULL,
+	"One of \"file\", \"directory\", \"link\" (broken symbolic link),\n"
+	"\"fifo\", \"socket\", \"char\", \"block\"", NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static PyObject *
+ZshGlobStat(UNUSED(PyObject *self), PyObject *args)
+{
+    char *str, *dup;
+    local_list1(list);
+    LinkNode node;
+    Py_ssize_t len, i;
+    PyObject *ret;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTuple(args, "s", &str))
+	return NULL;
+    dup = dupstring(str);
+    tokenize(dup);
+    init_list1(list, dup);
+
+    ZSH_BEGIN_ALLOW_THREADS
+    zglob(&list, firstnode(&list), 0);
+    ZSH_END_ALLOW_THREADS
+    if (check_glob_errors())
+	return NULL;
+
+    for (len = 0, node = firstnode(&list); node; node = nextnode(node))
+	len++;
+    if (!(ret = PyList_New(len)))
+	return NULL;
+
+    for (i = 0, node = firstnode(&list); node; i++, node = nextnode(node)) {
+	char *path = (char *) getdata(node), *upath = unmeta(path);
+	GlobEntryObject *entry;
+
+	if (!(entry = PyObject_NEW(GlobEntryObject, &GlobEntryType))) {
+	    Py_DECREF(ret);
+	    return NULL;
+	}
+	entry->path = NULL;
+	entry->pathobj = NULL;
+	PyList_SET_ITEM(ret, i, (PyObject *) entry);
+	if (!(entry->path = PyMem_Malloc(strlen(path) + 1))) {
+	    Py_DECREF(ret);
+	    return PyErr_NoMemory();
+	}
+	strcpy(entry->path, path);
+	/* Symbolic links are followed like glob qualifiers do, broken ones 
+	 * are reported as links */
+	if (stat(upath, &entry->st) == -1 && lstat(upath, &entry->st) == -1)
+	    memset(&entry->st, 0, sizeof(entry->st));
+    }
+    return ret;
+}
+
+/* Directory listings kept by zsh.glob_many(cache=True): directory part of 
+ * pattern -> (stamp, names). Names do not depend on options, so a listing 
+ * stays valid while directory keeps its device, inode and mtime. */
+static PyObject *glob_dir_cache = NULL;
+
+#define GLOB_DIR_CACHE_MAX 256
+
+/* Returns tokenized last component of pattern str if pattern can be matched 
+ * against names of one directory, storing directory part (with trailing 
+ * slash, empty for current directory) in *dirp. Returns NULL for patterns 
+ * left to zglob: wildcards before the last component, qualifiers, recursion, 
+ * exclusions and options which need to look at files. */
+static char *
+get_glob_component(char *str, char **dirp)
+{
+    char *slash, *pat, *dir;
+
+    if (!isset(GLOBOPT) || !isset(CASEGLOB) || isset(MARKDIRS)
+	    || strpbrk(str, "\\~"))
+	return NULL;
+    slash = strrchr(str, '/');
+    pat = dupstring(slash ? slash + 1 : str);
+    if (strchr(pat, '(') || strstr(pat, "**"))
+	return NULL;
+    tokenize(pat);
+    if (!haswilds(pat))
+	return NULL;
+    dir = slash ? dupstrpfx(str, slash - str + 1) : "";
+    if (*dir) {
+	char *tokdir = dupstring(dir);
+
+	tokenize(tokdir);
+	if (haswilds(tokdir))
+	    return NULL;
+    }
+    *dirp = dir;
+    return pat;
+}
+
+/* Returns new reference to list of metafied names in directory udir, 
+ * without . and .. */
+static PyObject *
+read_glob_dir(char *udir)
+{
+    LinkList list = newlinklist();
+    LinkNode node;
+    PyObject *r;
+    Py_ssize_t i;
+    DIR *dir;
+    char *name;
+
+    ZSH_BEGIN_ALLOW_THREADS
+    if ((dir = opendir(udir))) {
+	while ((name = zreaddir(dir, 1)))
+	    addlinknode(list, dupstring(name));
+	closedir(dir);
+    }
+    ZSH_END_ALLOW_THREADS
+
+    if (!(r = PyList_New(countlinknodes(list))))
+	return NULL;
+    for (i = 0, node = firstnode(list); node; i++, node = nextnode(node)) {
+	PyObject *s;
+
+	if (!(s = PyString_FromString((char *) getdata(node)))) {
+	    Py_DECREF(r);
+	    return NULL;
+	}
+	PyList_SET_ITEM(r, i, s);
+    }
+    return r;
+}
+
+/* Returns borrowed reference to names in directory dir, read once per call 
+ * into listings. With cache listing is taken from glob_dir_cache while 
+ * directory stamp is unchanged. Missing directory has no names. */
+static PyObject *
+get_glob_listing(char *dir, PyObject *listings, int cache)
+{
+    PyObject *key, *names = NULL, *stamp = NULL, *entry;
+    char *udir = *dir ? unmeta(dir) : ".";
+    struct stat st;
+    long nsec = 0;
+    int r;
+
+    if (!(key = PyString_FromString(dir)))
+	return NULL;
+    if ((names = PyDict_GetItem(listings, key))) {
+	Py_DECREF(key);
+	return names;
+    }
+    if (stat(udir, &st) == -1)
+	names = PyList_New(0);
+    else {
+#ifdef GET_ST_MTIME_NS
+	nsec = GET_ST_MTIME_NS(st);
+#endif
+	if (!(stamp = Py_BuildValue("(LLLl)", (long long) st.st_dev,
+			(long long) st.st_ino, (long long) st.st_mtime, nsec)))
+	    goto fail;
+	if (cache && (entry = PyDict_GetItem(glob_dir_cache, key))) {
+	    if ((r = PyObject_RichCompareBool(PyTuple_GET_ITEM(entry, 0), stamp,
+			    Py_EQ)) == -1)
+		goto fail;
+	    if (r) {
+		names = PyTuple_GET_ITEM(entry, 1);
+		Py_INCREF(names);
+	    }
+	}
+	if (!names) {
+	    if (!(names = read_glob_dir(udir)))
+		goto fail;
+	    /* Directory changed within the last second may change again 
+	     * without new mtime on file systems with coarse timestamps */
+	    if (cache && time(NULL) - st.st_mtime > 1) {
+		if (PyDict_Size(glob_dir_cache) >= GLOB_DIR_CACHE_MAX)
+		    PyDict_Clear(glob_dir_cache);
+		if (!(entry = Py_BuildValue("(OO)", stamp, names)))
+		    goto fail;
+		r = PyDict_SetItem(glob_dir_cache, key, entry);
+		Py_DECREF(entry);
+		if (r == -1)
+		    goto fail;
+	    }
+	}
+    }
+    if (!names || PyDict_SetItem(listings, key, names) == -1)
+	goto fail;
+    Py_XDECREF(stamp);
+    Py_DECREF(key);
+    Py_DECREF(names);
+    return names;
+
+fail:
+    Py_XDECREF(names);
+    Py_XDECREF(stamp);
+    Py_DECREF(key);
+    return NULL;
+}
+
+/* Returns new reference to list of names matching tokenized pattern 
+ * component pat, prefixed with dir and sorted like zglob sorts them. Returns 
+ * None if pattern does not compile so that zglob reports the error. */
+static PyObject *
+match_glob_listing(char *dir, char *pat, PyObject *names)
+{
+    Py_ssize_t len = PyList_GET_SIZE(names), count = 0, i;
+    /* Leading dot has to be matched explicitly unless GLOB_DOTS is set */
+    int dots = isset(GLOBDOTS) || *pat == '.';
+    char **matches;
+    PyObject *r;
+    Patprog prog;
+
+    if (!(prog = patcompile(pat, 0, NULL)))
+	Py_RETURN_NONE;
+    matches = (char **) zhalloc((len + 1) * sizeof(char *));
+    for (i = 0; i < len; i++) {
+	char *name = PyString_AS_STRING(PyList_GET_ITEM(names, i));
+
+	if ((dots || *name != '.') && pattry(prog, name))
+	    matches[count++] = dyncat(dir, name);
+    }
+    matches[count] = NULL;
+    strmetasort(matches, isset(NUMERICGLOBSORT) ? SORTIT_NUMERICALLY : 0,
+	    NULL);
+
+    if (!(r = PyList_New(count)))
+	return NULL;
+    for (i = 0; i < count; i++) {
+	PyObject *s;
+
+	if (!(s = get_string(matches[i]))) {
+	    Py_DECREF(r);
+	    return NULL;
+	}
+	PyList_SET_ITEM(r, i, s);
+    }
+    return r;
+}
+
+static PyObject *
+ZshGlobMany(UNUSED(PyObject *self), PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"patterns", "cache", NULL};
+    PyObject *patterns, *cacheobj = NULL, *listings, *iter, *item, *r;
+    struct batch_error err = {NULL, NULL};
+    int cache = 0;
+    char nullglob, cshnullglob;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist,
+		&patterns, &cacheobj))
+	return NULL;
+    if (cacheobj && (cache = PyObject_IsTrue(cacheobj)) == -1)
+	return NULL;
+
+    if (cache && !glob_dir_cache && !(glob_dir_cache = PyDict_New()))
+	return NULL;
+
+    if (!(iter = PyObject_GetIter(patterns)))
+	return NULL;
+    if (!(listings = PyDict_New())) {
+	Py_DECREF(iter);
+	return NULL;
+    }
+    if (!(r = PyList_New(0))) {
+	Py_DECREF(listings);
+	Py_DECREF(iter);
+	return NULL;
+    }
+
+    while ((item = PyIter_Next(iter))) {
+	PyObject *matches = NULL, *names;
+	char *str, *dir, *pat;
+
+	if (!(str = get_chars(item, zhalloc))) {
+	    Py_DECREF(item);
+	    break;
+	}
+	/* Patterns in the same directory share one read of it */
+	if ((pat = get_glob_component(str, &dir))
+		&& (!(names = get_glob_listing(dir, listings, cache))
+		    || !(matches = match_glob_listing(dir, pat, names)))) {
+	    Py_DECREF(item);
+	    break;
+	}
+	if (matches == Py_None)
+	    Py_CLEAR(matches);
+	if (!matches) {
+	    /* Pattern without matches gives empty list whatever NOMATCH and 
+	     * CSH_NULL_GLOB say */
+	    nullglob = opts[NULLGLOB];
+	    cshnullglob = opts[CSHNULLGLOB];
+	    opts[NULLGLOB] = 1;
+	    opts[CSHNULLGLOB] = 0;
+	    matches = glob_list(str);
+	    opts[NULLGLOB] = nullglob;
+	    opts[CSHNULLGLOB] = cshnullglob;
+	}
+	/* Only patterns without matches are collected, other errors leave zsh 
+	 * in error state */
+	if (!matches) {
+	    Py_DECREF(item);
+	    break;
+	}
+	if (!PyList_GET_SIZE(matches)) {
+	    PyErr_SetString(PyExc_ValueError, "No match");
+	    batch_error_add(&err, str);
+	}
+	if (PyList_Append(r, matches) == -1) {
+	    Py_DECREF(matches);
+	    Py_DECREF(item);
+	    break;
+	}
+	Py_DECREF(matches);
+	Py_DECREF(item);
+    }
+    Py_DECREF(iter);
+    Py_DECREF(listings);
+
+    if (PyErr_Occurred()) {
+	Py_XDECREF(err.type);
+	Py_DECREF(r);
+	return NULL;
+    }
+    if (batch_error_raise(&err, "glob patterns")) {
+	Py_DECREF(r);
+	return NULL;
+    }
+    return r;
+}
+
+
+#define FAIL_SETTING_ARRAY(val, arrlen, dealloc, failval) \
+	if (dealloc != NULL) { \
+	    while (val-- > valstart) \
+		dealloc(*val, strlen(*val)); \
+	    dealloc(valstart, arrlen); \
+	} \
+	return failval
+
+#define IS_PY_STRING(s) (PyString_Check(s) || PyUnicode_Check(s))
+
+static char **
+get_chars_array(PyObject *seq, Allocator alloc, DeAllocator dealloc)
+{
+    char **val, **valstart;
+    Py_ssize_t len = PySequence_Size(seq);
+    Py_ssize_t arrlen;
+    Py_ssize_t i = 0;
+
+    if (len == -1) {
+	PyErr_SetString(PyExc_ValueError, "Failed to get sequence size");
+	return NULL;
+    }
+
+    arrlen = (len + 1) * sizeof(char *);
+    val = (char **) alloc(arrlen);
+    valstart = val;
+
+    while (i < len) {
+	PyObject *item = PySequence_GetItem(seq, i);
+
+	if (!IS_PY_STRING(item)) {
+	    PyErr_SetString(PyExc_TypeError, "Sequence item is not a string");
+	    FAIL_SETTING_ARRAY(val, arrlen, dealloc, NULL);
+	}
+
+	if (!(*val++ = get_chars(item, alloc))) {
+	    FAIL_SETTING_ARRAY(val, arrlen, dealloc, NULL);
+	}
+	i++;
+    }
+    *val = NULL;
+
+    return valstart;
+}
+
+static int
+set_param_value(char *name, PyObject *value)
+{
+    if (!isident(name)) {
+	PyErr_SetString(PyExc_KeyError, "Parameter name is not an identifier");
+	return -1;
+    }
+
+    if (IS_PY_STRING(value)) {
+	char *s;
+
+	if (!(s = get_chars(value, zalloc)))
+	    return -1;
+
+	if (!setsparam(name, s)) {
+	    PyErr_SetString(PyExc_RuntimeError,
+		    "Failed to assign string to the parameter");
+	    zsfree(s);
+	    return -1;
+	}
+    }
+#if PY_MAJOR_VERSION < 3
+    else if (PyInt_Check(value)) {
+	if (!setiparam(name, (zlong) PyInt_AsLong(value))) {
+	    PyErr_SetString(PyExc_RuntimeError,
+		    "Failed to assign integer parameter");
+	    return -1;
+	}
+    }
+#endif
+    else if (PyLong_Check(value)) {
+	if (!setiparam(name, (zlong) PyLong_AsLong(value))) {
+	    PyErr_SetString(PyExc_RuntimeError,
+		    "Failed to assign long parameter");
+	    return -1;
+	}
+    }
+    else if (PyFloat_Check(value)) {
+	mnumber mnval;
+	mnval.type = MN_FLOAT;
+	mnval.u.d = PyFloat_AsDouble(value);
+	if (!setnparam(name, mnval)) {
+	    PyErr_SetString(PyExc_RuntimeError,
 		    "Failed to assign float parameter");
+	    return -1;
+	}
+    }
+    else if (PyDict_Check(value)) {
+	char **val, **valstart;
+	PyObject *pkey, *pval;
+	Py_ssize_t arrlen, pos = 0;
+
+	arrlen = (2 * PyDict_Size(value) + 1) * sizeof(char *);
+	val = (char **) zalloc(arrlen);
+	valstart = val;
+
+	while (PyDict_Next(value, &pos, &pkey, &pval)) {
+	    if (!IS_PY_STRING(pkey)) {
+		PyErr_SetString(PyExc_TypeError,
+			"Only string keys are allowed");
+		FAIL_SETTING_ARRAY(val, arrlen, zfree, -1);
+	    }
+	    if (!IS_PY_STRING(pval)) {
+		PyErr_SetString(PyExc_TypeError,
+			"Only string values are allowed");
+		FAIL_SETTING_ARRAY(val, arrlen, zfree, -1);
+	    }
+
+	    if (!(*val++ = get_chars(pkey, zalloc))) {
+		FAIL_SETTING_ARRAY(val, arrlen, zfree, -1);
+	    }
+	    if (!(*val++ = get_chars(pval, zalloc))) {
+		FAIL_SETTING_ARRAY(val, arrlen, zfree, -1);
+	    }
+	}
+	*val = NULL;
+
+	if (!sethparam(name, valstart)) {
+	    PyErr_SetString(PyExc_RuntimeError, "Failed to set hash");
+	    return -1;
+	}
+    }
+    /* Python's list have no faster shortcut methods like PyDict_Next above 
+     * thus using more abstract protocol */
+    else if (PySequence_Check(value)) {
+	char **ss = get_chars_array(value, zalloc, zfree);
+
+	if (!ss)
+	    return -1;
+
+	if (!setaparam(name, ss)) {
+	    PyErr_SetString(PyExc_RuntimeError, "Failed to set array");
+	    return -1;
+	}
+    }
+    else if (value == Py_None) {
+	unsetparam(name);
+	if (errflag) {
+	    PyErr_SetString(PyExc_RuntimeError, "Failed to delete parameter");
+	    return -1;
+	}
+    }
+    else {
+	PyErr_SetString(PyExc_TypeError,
+		"Cannot assign value of the given type");
+	return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+ZshSetValue(UNUSED(PyObject *self), PyObject *args)
+{
+    char *name;
+    PyObject *value;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTuple(args, "sO", &name, &value))
+	return NULL;
+
+    if (set_param_value(name, value) == -1)
+	return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ZshSetValues(UNUSED(PyObject *self), PyObject *mapping)
+{
+    PyObject *items, *seq;
+    struct batch_error err = {NULL, NULL};
+    Py_ssize_t i, len;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (PyDict_Check(mapping))
+	items = PyDict_Items(mapping);
+    else
+	items = PyMapping_Items(mapping);
+    if (!items)
+	return NULL;
+    /* Before Python 3.7 PyMapping_Items may return a view */
+    seq = PySequence_Fast(items, "Mapping items are not a sequence");
+    Py_DECREF(items);
+    if (!seq)
+	return NULL;
+    items = seq;
+
+    len = PySequence_Fast_GET_SIZE(items);
+    for (i = 0; i < len; i++) {
+	char *name;
+	PyObject *value;
+
+	if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(items, i), "sO",
+		    &name, &value))
+	    break;
+
+	if (set_param_value(name, value) == -1)
+	    batch_error_add(&err, name);
+    }
+    Py_DECREF(items);
+
+    if (PyErr_Occurred()) {
+	Py_XDECREF(err.type);
+	return NULL;
+    }
+    if (batch_error_raise(&err, "set parameters"))
+	return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ZshExitCode(UNUSED(PyObject *self), UNUSED(PyObject *args))
+{
+    if (check_main_thread())
+	return NULL;
+
+    return PyLong_FromLong((long) lastval);
+}
+
+static PyObject *
+ZshColumns(UNUSED(PyObject *self), UNUSED(PyObject *args))
+{
+    if (check_main_thread())
+	return NULL;
+
+    return PyLong_FromLong((long) zterm_columns);
+}
+
+static PyObject *
+ZshLines(UNUSED(PyObject *self), UNUSED(PyObject *args))
+{
+    if (check_main_thread())
+	return NULL;
+
+    return PyLong_FromLong((long) zterm_lines);
+}
+
+static PyObject *
+ZshSubshell(UNUSED(PyObject *self), UNUSED(PyObject *args))
+{
+    if (check_main_thread())
+	return NULL;
+
+    return PyLong_FromLong((long) zsh_subshell);
+}
+
+static PyObject *
+ZshPipeStatus(UNUSED(PyObject *self), UNUSED(PyObject *args))
+{
+    size_t i = 0;
+    PyObject *r;
+    PyObject *num;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!(r = PyList_New(numpipestats)))
+	return NULL;
+    while (i < numpipestats) {
+	if (!(num = PyLong_FromLong(pipestats[i]))) {
+	    Py_DECREF(r);
+	    return NULL;
+	}
+	if (PyList_SetItem(r, i, num) == -1) {
+	    Py_DECREF(r);
+	    return NULL;
+	}
+	i++;
+    }
+    return r;
+}
+
+static void
+free_sp(struct specialparam *sp)
+{
+    if (sp->prev)
+	sp->prev->next = sp->next;
+    else
+	first_assigned_param = sp->next;
+
+    if (sp->next)
+	sp->next->prev = sp->prev;
+    else
+	last_assigned_param = sp->prev;
+
+    zsfree(sp->name);
+    PyMem_Free(sp);
+}
+
+#define PROMPT_HOOK_NAME ZPYTHON_COMMAND_NAME "_prompt_generation"
+
+static int
+special_cache_valid(struct special_data *data)
+{
+    if (!data->cached)
+	return 0;
+
+    switch (data->cache) {
+    case SPECIAL_CACHE_TTL:
+	return get_time() < data->expires;
+    case SPECIAL_CACHE_PROMPT:
+	return data->generation == special_generation;
+    default:
+	return 1;
+    }
+}
+
+static void
+special_cache_clear(struct special_data *data)
+{
+    if (!data->cached)
+	return;
+
+    switch (data->type) {
+    case PM_SCALAR:
+	zsfree(data->value.str);
+	break;
+    case PM_ARRAY:
+	freearray(data->value.arr);
+	break;
+    }
+    data->cached = 0;
+}
+
+static int
+special_cache_memoized(struct special_data *data)
+{
+    return data->cache == SPECIAL_CACHE_MANUAL
+	|| data->cache == SPECIAL_CACHE_TTL
+	|| data->cache == SPECIAL_CACHE_PROMPT;
+}
+
+/* Drops cached value. Must be called with GIL held */
+static void
+special_invalidate(struct special_data *data)
+{
+    special_cache_clear(data);
+    if (data->cell) {
+	Py_INCREF(Py_None);
+	PyList_SetItem(data->cell, 0, Py_None);
+    }
+}
+
+static void
+special_cache_stored(struct special_data *data)
+{
+    data->cached = 1;
+    if (data->cache == SPECIAL_CACHE_TTL)
+	data->expires = get_time() + data->ttl;
+    data->generation = special_generation;
+}
+
+static void
+install_prompt_hook(void)
+{
+    if (prompt_hook_installed)
+	return;
+
+    execstring(PROMPT_HOOK_NAME "() { " ZPYTHON_COMMAND_NAME " -i }; "
+	    "(( ${precmd_functions[(I)" PROMPT_HOOK_NAME "]} )) || "
+	    "precmd_functions+=(" PROMPT_HOOK_NAME ")",
+	    1, 0, ZPYTHON_COMMAND_NAME);
+    prompt_hook_installed = 1;
+}
+
+static void
+remove_prompt_hook(void)
+{
+    if (!prompt_hook_installed)
+	return;
+
+    execstring("precmd_functions=(${precmd_functions:#" PROMPT_HOOK_NAME "}); "
+	    "unfunction " PROMPT_HOOK_NAME " 2>/dev/null",
+	    1, 0, ZPYTHON_COMMAND_NAME);
+    prompt_hook_installed = 0;
+}
+
+/* Converts special parameter object to the object holding its value */
+static PyObject *
+special_snapshot(int type, PyObject *obj)
+{
+    switch (type) {
+    case PM_SCALAR:
+	return PyObject_Str(obj);
+    case PM_INTEGER:
+	return PyNumber_Long(obj);
+    case PM_ARRAY:
+	return PySequence_List(obj);
+    default:
+	return PyNumber_Float(obj);
+    }
+}
+
+/* Refreshes of asynchronous special parameters are done by a single daemon 
+ * thread reading (type, object, cell, on_update, name) tuples from a queue, 
+ * None stops it. */
+static PyObject *refresh_queue = NULL;
+static PyObject *refresh_thread = NULL;
+static pid_t refresh_pid = 0;
+
+static PyObject *
+refresh_worker(UNUSED(PyObject *self), PyObject *queue)
+{
+    for (;;) {
+	PyObject *item, *obj, *cell, *on_update, *name, *value, *r;
+	int type;
+
+	if (!(item = PyObject_CallMethod(queue, "get", NULL)))
+	    return NULL;
+	if (item == Py_None) {
+	    Py_DECREF(item);
+	    Py_RETURN_NONE;
+	}
+	if (!PyArg_ParseTuple(item, "iOOOO", &type, &obj, &cell, &on_update,
+		    &name)) {
+	    Py_DECREF(item);
+	    return NULL;
+	}
+
+	if ((value = special_snapshot(type, obj)))
+	    PyList_SetItem(cell, 0, value);
+	else
+	    PyErr_PrintEx(0);
+	Py_INCREF(Py_False);
+	PyList_SetItem(cell, 1, Py_False);
+
+	if (value && on_update != Py_None) {
+	    if (!(r = PyObject_CallFunctionObjArgs(on_update, name, NULL)))
+		PyErr_PrintEx(0);
+	    else
+		Py_DECREF(r);
+	}
+	Py_DECREF(item);
+    }
+}
+
+static PyMethodDef refresh_worker_def =
+    {"zpython_refresh_worker", refresh_worker, METH_O, NULL};
+
+static int
+start_refresh_worker(void)
+{
+    PyObject *module, *target, *threading, *r;
+
+    /* Queue is left from the parent process, but not the thread */
+    if (refresh_thread && refresh_pid == getpid())
+	return 0;
+    Py_CLEAR(refresh_thread);
+    Py_CLEAR(refresh_queue);
+
+#if PY_MAJOR_VERSION >= 3
+    if (!(module = PyImport_ImportModule("queue")))
+#else
+    if (!(module = PyImport_ImportModule("Queue")))
+#endif
+	return 1;
+    refresh_queue = PyObject_CallMethod(module, "Queue", NULL);
+    Py_DECREF(module);
+    if (!refresh_queue)
+	return 1;
+
+    if (!(target = PyCFunction_New(&refresh_worker_def, NULL)))
+	return 1;
+    if (!(threading = PyImport_ImportModule("threading"))) {
+	Py_DECREF(target);
+	return 1;
+    }
+    /* Thread(group, target, name, args) */
+    refresh_thread = PyObject_CallMethod(threading, "Thread", "OOO(O)",
+	    Py_None, target, Py_None, refresh_queue);
+    Py_DECREF(threading);
+    Py_DECREF(target);
+    if (!refresh_thread)
+	return 1;
+    if (PyObject_SetAttrString(refresh_thread, "daemon", Py_True) == -1
+	    || !(r = PyObject_CallMethod(refresh_thread, "start", NULL))) {
+	Py_CLEAR(refresh_thread);
+	return 1;
+    }
+    Py_DECREF(r);
+    refresh_pid = getpid();
+
+    return 0;
+}
+
+static void
+stop_refresh_worker(void)
+{
+    PyObject *r;
+
+    if (refresh_thread && refresh_pid == getpid()) {
+	if (!(r = PyObject_CallMethod(refresh_queue, "put", "O", Py_None)))
+	    PyErr_PrintEx(0);
+	else {
+	    Py_DECREF(r);
+	    if (!(r = PyObject_CallMethod(refresh_thread, "join", NULL)))
+		PyErr_PrintEx(0);
+	    else
+		Py_DECREF(r);
+	}
+    }
+    Py_CLEAR(refresh_thread);
+    Py_CLEAR(refresh_queue);
+}
+
+/* Returns last value of asynchronous parameter, computing it if there is 
+ * none yet, and schedules refresh on the first access after precmd */
+static PyObject *
+get_async_value(struct special_data *data)
+{
+    PyObject *value = PyList_GET_ITEM(data->cell, 0);
+
+    if (value == Py_None) {
+	if (!(value = special_snapshot(data->type, data->obj)))
+	    return NULL;
+	Py_INCREF(value);
+	PyList_SetItem(data->cell, 0, value);
+	data->generation = special_generation;
+	return value;
+    }
+    Py_INCREF(value);
+
+    if (data->generation != special_generation
+	    && PyList_GET_ITEM(data->cell, 1) == Py_False) {
+	PyObject *r;
+
+	if (start_refresh_worker()
+		|| !(r = PyObject_CallMethod(refresh_queue, "put", "((iOOOs))",
+			data->type, data->obj, data->cell,
+			data->on_update ? data->on_update : Py_None,
+			data->sp->name))) {
+	    Py_DECREF(value);
+	    return NULL;
+	}
+	Py_DECREF(r);
+	Py_INCREF(Py_True);
+	PyList_SetItem(data->cell, 1, Py_True);
+	data->generation = special_generation;
+    }
+
+    return value;
+}
+
+/* Native value cells. Cell owns value of string, integer or float special 
+ * parameter so that zsh getters read it without touching interpreter: 
+ * numbers are accessed atomically and strings are published by atomic 
+ * pointer swap. Replaced strings are put to the retired list which is freed 
+ * by the next zsh read: zsh main thread is the only one reading cell strings 
+ * outside of the GIL. Memory is obtained with malloc as zsh allocator is not 
+ * thread-safe. */
+
+struct cell_string {
+    struct cell_string *next;
+    char str[1];
+};
+
+typedef struct {
+    PyObject_HEAD
+    int type;
+    struct cell_string *str;
+    struct cell_string *retired;
+    zlong i;
+    double f;
+    /* Last value set from Python, returned by get() */
+    PyObject *value;
+} CellObject;
+
+static PyTypeObject CellType;
+
+static void
+cell_free_strings(struct cell_string *cs)
+{
+    struct cell_string *next;
+
+    for (; cs; cs = next) {
+	next = cs->next;
+	free(cs);
+    }
+}
+
+/* Must be called with GIL held */
+static int
+cell_set(CellObject *cell, PyObject *value)
+{
+    PyObject *obj;
+
+    switch (cell->type) {
+    case PM_SCALAR:
+	{
+	    struct cell_string *cs, *old;
+	    char *chars;
+	    size_t len;
+
+	    if (!IS_PY_STRING(value)) {
+		PyErr_SetString(PyExc_TypeError, "String cell value must be str");
+		return -1;
+	    }
+	    if (!(chars = get_chars(value, PyMem_Malloc)))
+		return -1;
+	    len = strlen(chars);
+	    if (!(cs = malloc(offsetof(struct cell_string, str) + len + 1))) {
+		PyMem_Free(chars);
+		PyErr_NoMemory();
+		return -1;
+	    }
+	    memcpy(cs->str, chars, len + 1);
+	    PyMem_Free(chars);
+
+	    if ((old = __atomic_exchange_n(&cell->str, cs, __ATOMIC_ACQ_REL))) {
+		old->next = __atomic_load_n(&cell->retired, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&cell->retired, &old->next,
+			    old, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		    ;
+	    }
+	    break;
+	}
+    case PM_INTEGER:
+	{
+	    zlong i;
+
+	    if (!(obj = PyNumber_Long(value)))
+		return -1;
+	    i = (zlong) PyLong_AsLongLong(obj);
+	    Py_DECREF(obj);
+	    if (i == -1 && PyErr_Occurred())
+		return -1;
+	    __atomic_store(&cell->i, &i, __ATOMIC_RELEASE);
+	    break;
+	}
+    default:
+	{
+	    double f;
+
+	    if (!(obj = PyNumber_Float(value)))
+		return -1;
+	    f = PyFloat_AsDouble(obj);
+	    Py_DECREF(obj);
+	    __atomic_store(&cell->f, &f, __ATOMIC_RELEASE);
+	    break;
+	}
+    }
+
+    Py_INCREF(value);
+    Py_XDECREF(cell->value);
+    cell->value = value;
+    return 0;
+}
+
+static char *
+cell_get_string(CellObject *cell)
+{
+    cell_free_strings(__atomic_exchange_n(&cell->retired, NULL,
+		__ATOMIC_ACQUIRE));
+    return dupstring(__atomic_load_n(&cell->str, __ATOMIC_ACQUIRE)->str);
+}
+
+static zlong
+cell_get_integer(CellObject *cell)
+{
+    zlong i;
+
+    __atomic_load(&cell->i, &i, __ATOMIC_ACQUIRE);
+    return i;
+}
+
+static double
+cell_get_float(CellObject *cell)
+{
+    double f;
+
+    __atomic_load(&cell->f, &f, __ATOMIC_ACQUIRE);
+    return f;
+}
+
+static PyObject *
+CellNew(PyTypeObject *type, PyObject *args, UNUSED(PyObject *kwargs))
+{
+    CellObject *cell;
+    PyObject *value;
+
+    if (!PyArg_ParseTuple(args, "O", &value))
+	return NULL;
+
+    if (!(cell = (CellObject *) type->tp_alloc(type, 0)))
+	return NULL;
+
+    if (IS_PY_STRING(value))
+	cell->type = PM_SCALAR;
+    else if (PyFloat_Check(value))
+	cell->type = PM_EFLOAT;
+    else if (PyNumber_Check(value))
+	cell->type = PM_INTEGER;
+    else {
+	Py_DECREF(cell);
+	PyErr_SetString(PyExc_TypeError,
+		"Cell value must be str, int or float");
+	return NULL;
+    }
+
+    if (cell_set(cell, value) == -1) {
+	Py_DECREF(cell);
+	return NULL;
+    }
+
+    return (PyObject *) cell;
+}
+
+static void
+CellDealloc(PyObject *self)
+{
+    CellObject *cell = (CellObject *) self;
+
+    cell_free_strings(cell->str);
+    cell_free_strings(cell->retired);
+    Py_XDECREF(cell->value);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject *
+CellSet(PyObject *self, PyObject *value)
+{
+    if (cell_set((CellObject *) self, value) == -1)
+	return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CellGet(PyObject *self)
+{
+    CellObject *cell = (CellObject *) self;
+
+    Py_INCREF(cell->value);
+    return cell->value;
+}
+
+/* Assignment from zsh */
+static PyObject *
+CellCall(PyObject *self, PyObject *args, UNUSED(PyObject *kwargs))
+{
+    PyObject *value;
+
+    if (!PyArg_ParseTuple(args, "O", &value))
+	return NULL;
+
+    return CellSet(self, value);
+}
+
+static PyMethodDef CellMethods[] = {
+    {"set", CellSet, METH_O,
+	"Set cell value. Value is converted to the type of the initial value"},
+    {"get", (PyCFunction) CellGet, METH_NOARGS,
+	"Get the last value set from Python or zsh"},
+    {NULL, NULL, 0, NULL},
+};
+
+/* Writers installed as sys.stdout and sys.stderr by native-io option. They 
+ * write straight to zsh file descriptors 1 and 2 without any buffering, so 
+ * there is nothing to flush when entry point finishes. str is encoded with 
+ * the encoding of the replaced stream, with surrogateescape error handler on 
+ * Python 3 like standard streams do for undecodable file names. Each text 
+ * writer has binary writer for the same descriptor as its buffer attribute. */
+typedef struct {
+    PyObject_HEAD
+    int fd;
+    int softspace;
+    char *encoding;
+    /* Encoding is UTF-8: cached UTF-8 representation of str can be used */
+    int utf8;
+    /* Binary writer, NULL for binary writer itself */
+    PyObject *buffer;
+} WriterObject;
+
+static PyTypeObject WriterType;
+
+#if PY_MAJOR_VERSION >= 3
+# define WRITER_ERRORS "surrogateescape"
+#else
+# define WRITER_ERRORS "strict"
+#endif
+
+/* Returns 0 or errno */
+static int
+write_all(int fd, const char *buf, Py_ssize_t len)
+{
+    int err = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    while (len > 0) {
+	ssize_t n = write(fd, buf, (size_t) len);
+
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    err = errno;
+	    break;
+	}
+	buf += n;
+	len -= n;
+    }
+    Py_END_ALLOW_THREADS
+    return err;
+}
+
+static PyObject *
+WriterWrite(PyObject *self, PyObject *obj)
+{
+    WriterObject *writer = (WriterObject *) self;
+    PyObject *bytes = NULL;
+    Py_buffer view;
+    const char *buf = NULL;
+    Py_ssize_t len, r;
+    int err;
+
+    if (!writer->buffer) {
+	/* Binary writer accepts any bytes-like object */
+	if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) == -1)
+	    return NULL;
+	err = write_all(writer->fd, (const char *) view.buf, view.len);
+	r = view.len;
+	PyBuffer_Release(&view);
+	if (err) {
+	    errno = err;
+	    return PyErr_SetFromErrno(PyExc_IOError);
+	}
+	return PyLong_FromSsize_t(r);
+    }
+
+    if (PyUnicode_Check(obj)) {
+#if PY_MAJOR_VERSION >= 3
+	/* UTF-8 representation is cached in the object, it fails for lone 
+	 * surrogates which are then handled by the encoder */
+	if (writer->utf8 && !(buf = PyUnicode_AsUTF8AndSize(obj, &len))) {
+	    if (!PyErr_ExceptionMatches(PyExc_UnicodeEncodeError))
+		return NULL;
+	    PyErr_Clear();
+	}
+	r = PyUnicode_GET_LENGTH(obj);
+#else
+	r = PyUnicode_GET_SIZE(obj);
+#endif
+	if (!buf) {
+	    if (!(bytes = PyUnicode_AsEncodedString(obj, writer->encoding,
+			    WRITER_ERRORS)))
+		return NULL;
+	    buf = PyString_AS_STRING(bytes);
+	    len = PyString_GET_SIZE(bytes);
+	}
+    }
+    else if (PyString_Check(obj)) {
+	buf = PyString_AS_STRING(obj);
+	r = len = PyString_GET_SIZE(obj);
+    }
+    else {
+	PyErr_SetString(PyExc_TypeError, "Argument must be a string");
+	return NULL;
+    }
+
+    err = write_all(writer->fd, buf, len);
+    Py_XDECREF(bytes);
+
+    if (err) {
+	errno = err;
+	return PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+    return PyLong_FromSsize_t(r);
+}
+
+static PyObject *
+WriterWriteLines(PyObject *self, PyObject *lines)
+{
+    PyObject *iter, *line, *r;
+
+    if (!(iter = PyObject_GetIter(lines)))
+	return NULL;
+    while ((line = PyIter_Next(iter))) {
+	r = WriterWrite(self, line);
+	Py_DECREF(line);
+	if (!r)
+	    break;
+	Py_DECREF(r);
+    }
+    Py_DECREF(iter);
+    if (PyErr_Occurred())
+	return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+WriterFlush(UNUSED(PyObject *self), UNUSED(PyObject *args))
+{
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+WriterFileno(PyObject *self, UNUSED(PyObject *args))
+{
+    return PyLong_FromLong((long) ((WriterObject *) self)->fd);
+}
+
+static PyObject *
+WriterIsatty(PyObject *self, UNUSED(PyObject *args))
+{
+    return PyBool_FromLong(isatty(((WriterObject *) self)->fd));
+}
+
+static PyObject *
+WriterWritable(UNUSED(PyObject *self), UNUSED(PyObject *args))
+{
+    Py_RETURN_TRUE;
+}
+
+static void
+WriterDealloc(WriterObject *self)
+{
+    Py_XDECREF(self->buffer);
+    zsfree(self->encoding);
+    PyObject_Del(self);
+}
+
+static PyMethodDef WriterMethods[] = {
+    {"write", WriterWrite, METH_O,
+	"Write string to the file descriptor, returns number of characters written"},
+    {"writelines", WriterWriteLines, METH_O,
+	"Write each string from iterable, no line separators are added"},
+    {"flush", WriterFlush, METH_NOARGS, "Does nothing: writer is not buffered"},
+    {"fileno", WriterFileno, METH_NOARGS, "Returns file descriptor"},
+    {"isatty", WriterIsatty, METH_NOARGS,
+	"Returns True if file descriptor is a terminal"},
+    {"writable", WriterWritable, METH_NOARGS, "Returns True"},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyObject *
+WriterGetEncoding(PyObject *self, UNUSED(void *closure))
+{
+    return Py_BuildValue("s", ((WriterObject *) self)->encoding);
+}
+
+static PyObject *
+WriterGetErrors(UNUSED(PyObject *self), UNUSED(void *closure))
+{
+    return Py_BuildValue("s", WRITER_ERRORS);
+}
+
+static PyObject *
+WriterGetBuffer(PyObject *self, UNUSED(void *closure))
+{
+    PyObject *buffer = ((WriterObject *) self)->buffer;
+
+    if (!buffer) {
+	PyErr_SetString(PyExc_AttributeError,
+		"Binary writer has no buffer attribute");
+	return NULL;
+    }
+    Py_INCREF(buffer);
+    return buffer;
+}
+
+static PyObject *
+WriterGetClosed(UNUSED(PyObject *self), UNUSED(void *closure))
+{
+    Py_RETURN_FALSE;
+}
+
+/* softspace is used by print statement of Python 2 */
+static PyObject *
+WriterGetSoftspace(PyObject *self, UNUSED(void *closure))
+{
+    return PyLong_FromLong((long) ((WriterObject *) self)->softspace);
+}
+
+static int
+WriterSetSoftspace(PyObject *self, PyObject *value, UNUSED(void *closure))
+{
+    int r;
+
+    if (!value || (r = PyObject_IsTrue(value)) == -1)
+	return -1;
+    ((WriterObject *) self)->softspace = r;
+    return 0;
+}
+
+static PyGetSetDef WriterGetSet[] = {
+    {"encoding", WriterGetEncoding, NULL, "Encoding used for str", NULL},
+    {"errors", WriterGetErrors, NULL, "Encoding error handler", NULL},
+    {"buffer", WriterGetBuffer, NULL,
+	"Writer of bytes to the same file descriptor", NULL},
+    {"closed", WriterGetClosed, NULL, "Always False", NULL},
+    {"softspace", WriterGetSoftspace, WriterSetSoftspace, NULL, NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+/* Returns encoding of stream sys.name which is about to be replaced, UTF-8 if 
+ * it has none. Binary writer has no encoding. */
+static char *
+get_stream_encoding(char *name)
+{
+    PyObject *stream, *encobj;
+    char *encoding = NULL;
+
+    if ((stream = PySys_GetObject(name))
+	    && (encobj = PyObject_GetAttrString(stream, "encoding"))) {
+	if (PyString_Check(encobj))
+	    encoding = ztrdup(PyString_AS_STRING(encobj));
+#if PY_MAJOR_VERSION >= 3
+	else if (PyUnicode_Check(encobj) && PyUnicode_AsUTF8(encobj))
+	    encoding = ztrdup(PyUnicode_AsUTF8(encobj));
+#endif
+	Py_DECREF(encobj);
+    }
+    PyErr_Clear();
+    return encoding ? encoding : ztrdup("utf-8");
+}
+
+static WriterObject *
+new_writer(int fd, char *name)
+{
+    WriterObject *writer, *buffer;
+    char *e;
+
+    if (!(buffer = PyObject_NEW(WriterObject, &WriterType)))
+	return NULL;
+    buffer->fd = fd;
+    buffer->softspace = 0;
+    buffer->buffer = NULL;
+    buffer->utf8 = 0;
+    buffer->encoding = NULL;
+    if (!(writer = PyObject_NEW(WriterObject, &WriterType))) {
+	Py_DECREF(buffer);
+	return NULL;
+    }
+    writer->fd = fd;
+    writer->softspace = 0;
+    writer->buffer = (PyObject *) buffer;
+    writer->encoding = get_stream_encoding(name);
+    for (e = writer->encoding; *e; e++)
+	*e = tolower((unsigned char) *e);
+    writer->utf8 = !strcmp(writer->encoding, "utf-8")
+	|| !strcmp(writer->encoding, "utf8");
+    return writer;
+}
+
+static int
+install_native_io(void)
+{
+    WriterObject *out, *err;
+
+    if (!(out = new_writer(1, "stdout")))
+	return 1;
+    if (!(err = new_writer(2, "stderr"))) {
+	Py_DECREF(out);
+	return 1;
+    }
+
+    if (PySys_SetObject("stdout", (PyObject *) out) == -1
+	    || PySys_SetObject("stderr", (PyObject *) err) == -1) {
+	Py_DECREF(out);
+	Py_DECREF(err);
+	return 1;
+    }
+#if PY_MAJOR_VERSION >= 3
+    {
+	PyObject *module;
+
+	if (!(module = PyImport_ImportModule("sys"))) {
+	    Py_DECREF(out);
+	    Py_DECREF(err);
+	    return 1;
+	}
+	/* Streams are looked up in the dictionary by flush_io */
+	sys_dict = PyModule_GetDict(module);
+	Py_INCREF(sys_dict);
+	Py_DECREF(module);
+	stdout_key = PyUnicode_InternFromString("stdout");
+	stderr_key = PyUnicode_InternFromString("stderr");
+	if (!stdout_key || !stderr_key) {
+	    Py_CLEAR(sys_dict);
+	    Py_CLEAR(stdout_key);
+	    Py_CLEAR(stderr_key);
+	    Py_DECREF(out);
+	    Py_DECREF(err);
+	    return 1;
+	}
+    }
+#endif
+    native_stdout = (PyObject *) out;
+    native_stderr = (PyObject *) err;
+    return 0;
+}
+
+/* View over zsh hash parameter or, if name is NULL, over parameter table. 
+ * Parameter is looked up again on each access, so the view never keeps 
+ * pointers into zsh tables and sees reassignments. */
+typedef struct {
+    PyObject_HEAD
+    char *name;
+} HashViewObject;
+
+static PyTypeObject HashViewType;
+
+/* Iterator kinds */
+#define HASHVIEW_KEYS   0
+#define HASHVIEW_VALUES 1
+#define HASHVIEW_ITEMS  2
+
+typedef struct {
+    PyObject_HEAD
+    HashViewObject *view;
+    int kind;
+    /* Table being walked, only compared with the current one */
+    HashTable ht;
+    int hsize;
+    int bucket;
+    int chainpos;
+    /* Snapshot of names for special hashes which can only be scanned */
+    PyObject *keys;
+    Py_ssize_t keypos;
+} HashViewIterObject;
+
+static PyTypeObject HashViewIterType;
+
+/* Returns 0 and sets *htp to the viewed table, NULL if hash is empty */
+static int
+get_view_table(HashViewObject *view, HashTable *htp)
+{
+    Param pm;
+
+    if (check_main_thread())
+	return -1;
+
+    if (!view->name) {
+	*htp = realparamtab;
+	return 0;
+    }
+    if (!(pm = (Param) paramtab->getnode(paramtab, view->name))
+	    || (pm->node.flags & PM_UNSET)) {
+	PyErr_Format(PyExc_KeyError, "Parameter %s no longer exists",
+		view->name);
+	return -1;
+    }
+    if (PM_TYPE(pm->node.flags) != PM_HASHED) {
+	PyErr_Format(PyExc_TypeError, "Parameter %s is no longer a hash",
+		view->name);
+	return -1;
+    }
+    *htp = pm->gsu.h->getfn(pm);
+    return 0;
+}
+
+/* Returns set element or parameter, NULL without exception if there is none */
+static Param
+get_view_node(HashTable ht, char *key)
+{
+    Param pm;
+
+    if (!ht || !(pm = (Param) ht->getnode(ht, key))
+	    || (pm->node.flags & PM_UNSET))
+	return NULL;
+    return pm;
+}
+
+static PyObject *
+get_view_value(HashViewObject *view, Param pm)
+{
+    if (!view->name)
+	return get_param_value(pm->node.nam);
+    return get_element_string(pm);
+}
+
+static PyObject *
+HashViewItem(HashViewObject *self, PyObject *keyobj)
+{
+    HashTable ht;
+    char *key;
+    Param pm;
+
+    if (!(key = get_chars(keyobj, zhalloc)))
+	return NULL;
+    if (get_view_table(self, &ht) == -1)
+	return NULL;
+    if (!(pm = get_view_node(ht, key))) {
+	PyErr_SetObject(PyExc_KeyError, keyobj);
+	return NULL;
+    }
+    return get_view_value(self, pm);
+}
+
+static int
+HashViewAssItem(HashViewObject *self, PyObject *keyobj, PyObject *valobj)
+{
+    HashTable ht, outer;
+    struct value v;
+    char *key, *val;
+
+    if (!(key = get_chars(keyobj, zhalloc)))
+	return -1;
+    if (get_view_table(self, &ht) == -1)
+	return -1;
+
+    if (!self->name) {
+	if (valobj)
+	    return set_param_value(key, valobj);
+	if (!get_view_node(ht, key)) {
+	    PyErr_SetObject(PyExc_KeyError, keyobj);
+	    return -1;
+	}
+	unsetparam(key);
+	if (errflag) {
+	    PyErr_SetString(PyExc_RuntimeError, "Failed to delete parameter");
+	    return -1;
+	}
+	return 0;
+    }
+
+    if (!ht) {
+	PyErr_Format(PyExc_RuntimeError, "Parameter %s has no table",
+		self->name);
+	return -1;
+    }
+
+    /* Elements are created and removed the way zsh does for hash[key] 
+     * assignments and unset, with element table as paramtab */
+    if (!valobj) {
+	if (!get_view_node(ht, key)) {
+	    PyErr_SetObject(PyExc_KeyError, keyobj);
+	    return -1;
+	}
+	outer = paramtab;
+	paramtab = ht;
+	unsetparam(key);
+	paramtab = outer;
+	if (errflag) {
+	    PyErr_SetString(PyExc_RuntimeError, "Failed to delete element");
+	    return -1;
+	}
+	return 0;
+    }
+
+    if (!IS_PY_STRING(valobj)) {
+	PyErr_SetString(PyExc_TypeError, "Only string values are allowed");
+	return -1;
+    }
+    if (!(v.pm = (Param) ht->getnode(ht, key))) {
+	outer = paramtab;
+	paramtab = ht;
+	v.pm = createparam(key, PM_SCALAR|PM_UNSET);
+	paramtab = outer;
+	if (!v.pm) {
+	    PyErr_SetString(PyExc_RuntimeError, "Failed to create element");
+	    return -1;
+	}
+    }
+    if (!(val = get_chars(valobj, zalloc)))
+	return -1;
+    v.isarr = 0;
+    v.flags = 0;
+    v.start = 0;
+    v.end = -1;
+    setstrvalue(&v, val);
+    if (errflag) {
+	PyErr_SetString(PyExc_RuntimeError, "Failed to assign element");
+	return -1;
+    }
+    return 0;
+}
+
+static int
+HashViewContains(HashViewObject *self, PyObject *keyobj)
+{
+    HashTable ht;
+    char *key;
+
+    if (!(key = get_chars(keyobj, zhalloc)))
+	return -1;
+    if (get_view_table(self, &ht) == -1)
+	return -1;
+    return get_view_node(ht, key) != NULL;
+}
+
+static Py_ssize_t hashview_count;
+
+static void
+scanhashcount(UNUSED(HashNode hn), UNUSED(int flags))
+{
+    hashview_count++;
+}
+
+static PyObject *hashview_keys = NULL;
+
+static void
+scanhashkeys(HashNode hn, UNUSED(int flags))
+{
+    PyObject *key;
+
+    if (hashview_keys == NULL)
+	return;
+    if (!(key = get_string(hn->nam)) || PyList_Append(hashview_keys, key)) {
+	Py_XDECREF(key);
+	Py_CLEAR(hashview_keys);
+	return;
+    }
+    Py_DECREF(key);
+}
+
+static Py_ssize_t
+HashViewLength(HashViewObject *self)
+{
+    HashTable ht;
+    Py_ssize_t outer, r;
+
+    if (get_view_table(self, &ht) == -1)
+	return -1;
+    if (!ht)
+	return 0;
+
+    /* Special hash may run Python code counting another hash */
+    outer = hashview_count;
+    hashview_count = 0;
+    scanhashtable(ht, 0, 0, PM_UNSET, scanhashcount, 0);
+    r = hashview_count;
+    hashview_count = outer;
+    return r;
+}
+
+static PyObject *
+hashview_iter_new(HashViewObject *view, int kind)
+{
+    HashViewIterObject *iter;
+    HashTable ht;
+
+    if (get_view_table(view, &ht) == -1)
+	return NULL;
+    if (!(iter = PyObject_NEW(HashViewIterObject, &HashViewIterType)))
+	return NULL;
+
+    Py_INCREF(view);
+    iter->view = view;
+    iter->kind = kind;
+    iter->ht = ht;
+    iter->hsize = ht ? ht->hsize : 0;
+    iter->bucket = 0;
+    iter->chainpos = 0;
+    iter->keys = NULL;
+    iter->keypos = 0;
+
+    /* Special hashes do not keep nodes in buckets: only names are collected 
+     * here, values are still converted lazily */
+    if (ht && ht->scantab) {
+	PyObject *outer = hashview_keys;
+
+	if (!(hashview_keys = PyList_New(0))) {
+	    hashview_keys = outer;
+	    Py_DECREF(iter);
+	    return NULL;
+	}
+	scanhashtable(ht, 0, 0, PM_UNSET, scanhashkeys, 0);
+	iter->keys = hashview_keys;
+	hashview_keys = outer;
+	if (!iter->keys) {
+	    Py_DECREF(iter);
+	    return NULL;
+	}
+    }
+    return (PyObject *) iter;
+}
+
+static void
+HashViewIterDealloc(HashViewIterObject *self)
+{
+    Py_XDECREF(self->keys);
+    Py_DECREF(self->view);
+    PyObject_Del(self);
+}
+
+static PyObject *
+hashview_iter_result(HashViewIterObject *self, PyObject *keyobj, Param pm)
+{
+    PyObject *valobj, *r;
+
+    if (self->kind == HASHVIEW_KEYS)
+	return keyobj;
+    if (!(valobj = get_view_value(self->view, pm))) {
+	Py_DECREF(keyobj);
+	return NULL;
+    }
+    if (self->kind == HASHVIEW_VALUES) {
+	Py_DECREF(keyobj);
+	return valobj;
+    }
+    r = PyTuple_Pack(2, keyobj, valobj);
+    Py_DECREF(keyobj);
+    Py_DECREF(valobj);
+    return r;
+}
+
+static PyObject *
+HashViewIterNext(HashViewIterObject *self)
+{
+    HashTable ht;
+    HashNode hn;
+    int i;
+
+    if (get_view_table(self->view, &ht) == -1)
+	return NULL;
+    if (ht != self->ht || (ht && ht->hsize != self->hsize)) {
+	PyErr_SetString(PyExc_RuntimeError,
+		"hash was reassigned or resized during iteration");
+	return NULL;
+    }
+    if (!ht)
+	return NULL;
+
+    if (self->keys) {
+	while (self->keypos < PyList_GET_SIZE(self->keys)) {
+	    PyObject *keyobj = PyList_GET_ITEM(self->keys, self->keypos++);
+	    char *key;
+	    Param pm;
+
+	    if (!(key = get_chars(keyobj, zhalloc)))
+		return NULL;
+	    /* Skip elements removed since iteration started */
+	    if (!(pm = get_view_node(ht, key)))
+		continue;
+	    Py_INCREF(keyobj);
+	    return hashview_iter_result(self, keyobj, pm);
+	}
+	return NULL;
+    }
+
+    /* Position is kept as bucket and index in its chain: nodes may be freed 
+     * between calls */
+    for (; self->bucket < ht->hsize; self->bucket++, self->chainpos = 0) {
+	for (hn = ht->nodes[self->bucket], i = 0; hn && i < self->chainpos;
+		i++)
+	    hn = hn->next;
+	for (; hn; hn = hn->next) {
+	    self->chainpos++;
+	    if (!(hn->flags & PM_UNSET)) {
+		PyObject *keyobj;
+
+		if (!(keyobj = get_string(hn->nam)))
+		    return NULL;
+		return hashview_iter_result(self, keyobj, (Param) hn);
+	    }
+	}
+    }
+    return NULL;
+}
+
+static PyObject *
+HashViewIterIter(PyObject *self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject *
+HashViewIter(HashViewObject *self)
+{
+    return hashview_iter_new(self, HASHVIEW_KEYS);
+}
+
+static PyObject *
+HashViewKeys(HashViewObject *self)
+{
+    return hashview_iter_new(self, HASHVIEW_KEYS);
+}
+
+static PyObject *
+HashViewValues(HashViewObject *self)
+{
+    return hashview_iter_new(self, HASHVIEW_VALUES);
+}
+
+static PyObject *
+HashViewItems(HashViewObject *self)
+{
+    return hashview_iter_new(self, HASHVIEW_ITEMS);
+}
+
+static PyObject *
+HashViewGet(HashViewObject *self, PyObject *args)
+{
+    PyObject *keyobj, *def = Py_None;
+    HashTable ht;
+    char *key;
+    Param pm;
+
+    if (!PyArg_ParseTuple(args, "O|O", &keyobj, &def))
+	return NULL;
+    if (!(key = get_chars(keyobj, zhalloc)))
+	return NULL;
+    if (get_view_table(self, &ht) == -1)
+	return NULL;
+    if (!(pm = get_view_node(ht, key))) {
+	Py_INCREF(def);
+	return def;
+    }
+    return get_view_value(self, pm);
+}
+
+static PyObject *
+HashViewCopy(HashViewObject *self)
+{
+    HashViewIterObject *iter;
+    PyObject *r, *item;
+    HashTable ht;
+
+    if (get_view_table(self, &ht) == -1)
+	return NULL;
+    if (self->name)
+	return get_hash(ht);
+
+    if (!(r = _PyDict_NewPresized(ht->ct)))
+	return NULL;
+    if (!(iter = (HashViewIterObject *) hashview_iter_new(self,
+		    HASHVIEW_ITEMS))) {
+	Py_DECREF(r);
+	return NULL;
+    }
+    while ((item = HashViewIterNext(iter))) {
+	if (PyDict_SetItem(r, PyTuple_GET_ITEM(item, 0),
+		    PyTuple_GET_ITEM(item, 1)) == -1) {
+	    Py_DECREF(item);
+	    break;
+	}
+	Py_DECREF(item);
+    }
+    Py_DECREF(iter);
+    if (PyErr_Occurred()) {
+	Py_DECREF(r);
+	return NULL;
+    }
+    return r;
+}
+
+static void
+HashViewDealloc(HashViewObject *self)
+{
+    zsfree(self->name);
+    PyObject_Del(self);
+}
+
+static PyMethodDef HashViewMethods[] = {
+    {"keys", (PyCFunction) HashViewKeys, METH_NOARGS,
+	"Iterator over names"},
+    {"values", (PyCFunction) HashViewValues, METH_NOARGS,
+	"Iterator over values, each converted when it is reached"},
+    {"items", (PyCFunction) HashViewItems, METH_NOARGS,
+	"Iterator over (name, value) tuples"},
+    {"get", (PyCFunction) HashViewGet, METH_VARARGS,
+	"Return value or second argument (defaults to None) if it is not found"},
+    {"copy", (PyCFunction) HashViewCopy, METH_NOARGS,
+	"Returns a dictionary with all values converted"},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyMappingMethods HashViewAsMapping = {
+    (lenfunc) HashViewLength,
+    (binaryfunc) HashViewItem,
+    (objobjargproc) HashViewAssItem,
+};
+
+static PySequenceMethods HashViewAsSeq = {
+    0,					/* sq_length */
+    0,					/* sq_concat */
+    0,					/* sq_repeat */
+    0,					/* sq_item */
+    0,					/* sq_slice */
+    0,					/* sq_ass_item */
+    0,					/* sq_ass_slice */
+    (objobjproc) HashViewContains,	/* sq_contains */
+    0,					/* sq_inplace_concat */
+    0,					/* sq_inplace_repeat */
+};
+
+/* Read-only view over zsh array parameter. Length is recomputed on each 
+ * access that needs it, iteration walks up to the NULL terminator instead. 
+ * Array is also compared with the one seen when view was created: zsh 
+ * usually replaces the whole array when it or any of its elements is 
+ * assigned, but freed memory may be reused by the new array, so this only 
+ * detects reassignment on a best-effort basis. */
+typedef struct {
+    PyObject_HEAD
+    char *name;
+    /* Array seen when view was created, only compared with the current one */
+    char **arr;
+    /* Special arrays computed on each access can not be checked */
+    int computed;
+} ArrayViewObject;
+
+static PyTypeObject ArrayViewType;
+
+/* Returns current array, sets *lenp to its length unless lenp is NULL */
+static char **
+get_view_array(ArrayViewObject *view, Py_ssize_t *lenp)
+{
+    Param pm;
+    char **arr;
+
+    if (check_main_thread())
+	return NULL;
+    if (!(pm = (Param) paramtab->getnode(paramtab, view->name))
+	    || (pm->node.flags & PM_UNSET)) {
+	PyErr_Format(PyExc_KeyError, "Parameter %s no longer exists",
+		view->name);
+	return NULL;
+    }
+    if (PM_TYPE(pm->node.flags) != PM_ARRAY) {
+	PyErr_Format(PyExc_TypeError, "Parameter %s is no longer an array",
+		view->name);
+	return NULL;
+    }
+    arr = pm->gsu.a->getfn(pm);
+    if (!view->computed && arr != view->arr) {
+	PyErr_Format(PyExc_RuntimeError, "Parameter %s was reassigned",
+		view->name);
+	return NULL;
+    }
+    if (lenp)
+	*lenp = arrlen(arr);
+    return arr;
+}
+
+static PyObject *
+get_view_item(char **arr, Py_ssize_t len, Py_ssize_t i)
+{
+    if (i < 0 || i >= len) {
+	PyErr_SetString(PyExc_IndexError, "array index out of range");
+	return NULL;
+    }
+    return get_string(arr[i]);
+}
+
+static Py_ssize_t
+ArrayViewLength(ArrayViewObject *self)
+{
+    Py_ssize_t len;
+
+    if (!get_view_array(self, &len))
+	return -1;
+    return len;
+}
+
+static PyObject *
+ArrayViewItem(ArrayViewObject *self, Py_ssize_t i)
+{
+    Py_ssize_t len;
+    char **arr;
+
+    if (!(arr = get_view_array(self, &len)))
+	return NULL;
+    return get_view_item(arr, len, i);
+}
+
+static PyObject *
+ArrayViewSubscript(ArrayViewObject *self, PyObject *item)
+{
+    Py_ssize_t len, start, stop, step, slicelen, i;
+    PyObject *r;
+    char **arr;
+
+    if (PyIndex_Check(item)) {
+	if ((i = PyNumber_AsSsize_t(item, PyExc_IndexError)) == -1
+		&& PyErr_Occurred())
+	    return NULL;
+	if (!(arr = get_view_array(self, &len)))
+	    return NULL;
+	return get_view_item(arr, len, i < 0 ? i + len : i);
+    }
+    if (!PySlice_Check(item)) {
+	PyErr_SetString(PyExc_TypeError,
+		"array view indices must be integers or slices");
+	return NULL;
+    }
+
+    if (!(arr = get_view_array(self, &len)))
+	return NULL;
+#if PY_MAJOR_VERSION < 3
+    if (PySlice_GetIndicesEx((PySliceObject *) item, len, &start, &stop,
+		&step, &slicelen) == -1)
+#else
+    if (PySlice_GetIndicesEx(item, len, &start, &stop, &step, &slicelen) == -1)
+#endif
+	return NULL;
+
+    /* Only elements in the slice are converted */
+    if (!(r = PyList_New(slicelen)))
+	return NULL;
+    for (i = 0; i < slicelen; i++, start += step) {
+	PyObject *str;
+
+	if (!(str = get_string(arr[start]))) {
+	    Py_DECREF(r);
+	    return NULL;
+	}
+	PyList_SET_ITEM(r, i, str);
+    }
+    return r;
+}
+
+static PyObject *
+ArrayViewCopy(ArrayViewObject *self)
+{
+    Py_ssize_t len;
+    char **arr;
+
+    if (!(arr = get_view_array(self, &len)))
+	return NULL;
+    return get_array(arr);
+}
+
+static void
+ArrayViewDealloc(ArrayViewObject *self)
+{
+    zsfree(self->name);
+    PyObject_Del(self);
+}
+
+/* Iterator over array view. Array is looked up again on each step, so 
+ * reassignment is noticed as by the view itself. Position is checked against 
+ * the NULL terminator: arrays of special parameters are computed anew on each 
+ * access and may become shorter. */
+typedef struct {
+    PyObject_HEAD
+    ArrayViewObject *view;
+    Py_ssize_t pos;
+} ArrayViewIterObject;
+
+static PyTypeObject ArrayViewIterType;
+
+static PyObject *
+ArrayViewIterNext(ArrayViewIterObject *self)
+{
+    char **arr, **p;
+
+    if (!self->view)
+	return NULL;
+    if (!(arr = get_view_array(self->view, NULL)))
+	return NULL;
+    if (self->view->computed) {
+	for (p = arr; p < arr + self->pos && *p; p++)
+	    ;
+    }
+    else
+	p = arr + self->pos;
+    if (!*p) {
+	Py_CLEAR(self->view);
+	return NULL;
+    }
+    self->pos++;
+    return get_string(*p);
+}
+
+static PyObject *
+ArrayViewIterIter(PyObject *self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static void
+ArrayViewIterDealloc(ArrayViewIterObject *self)
+{
+    Py_XDECREF(self->view);
+    PyObject_Del(self);
+}
+
+static PyObject *
+ArrayViewIter(ArrayViewObject *self)
+{
+    ArrayViewIterObject *iter;
+
+    if (!get_view_array(self, NULL))
+	return NULL;
+    if (!(iter = PyObject_NEW(ArrayViewIterObject, &ArrayViewIterType)))
+	return NULL;
+    Py_INCREF(self);
+    iter->view = self;
+    iter->pos = 0;
+    return (PyObject *) iter;
+}
+
+static PyMethodDef ArrayViewMethods[] = {
+    {"copy", (PyCFunction) ArrayViewCopy, METH_NOARGS,
+	"Returns a list with all elements converted"},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyMappingMethods ArrayViewAsMapping = {
+    (lenfunc) ArrayViewLength,
+    (binaryfunc) ArrayViewSubscript,
+    0,
+};
+
+static PySequenceMethods ArrayViewAsSeq = {
+    (lenfunc) ArrayViewLength,		/* sq_length */
+    0,					/* sq_concat */
+    0,					/* sq_repeat */
+    (ssizeargfunc) ArrayViewItem,	/* sq_item */
+    0,					/* sq_slice */
+    0,					/* sq_ass_item */
+    0,					/* sq_ass_slice */
+    0,					/* sq_contains */
+    0,					/* sq_inplace_concat */
+    0,					/* sq_inplace_repeat */
+};
+
+static PyObject *
+new_array_view(char *name, Param pm)
+{
+    ArrayViewObject *view;
+
+    if (!(view = PyObject_NEW(ArrayViewObject, &ArrayViewType)))
+	return NULL;
+    view->name = ztrdup(name);
+    view->arr = pm->gsu.a->getfn(pm);
+    view->computed = (pm->gsu.a->getfn(pm) != view->arr);
+    return (PyObject *) view;
+}
+
+/* Read-only buffer over zsh scalar parameter. Value is unmetafied into buffer 
+ * owned by the view: parameter storage may be freed by any assignment while 
+ * consumer still holds the buffer, and address of the new value may be the 
+ * same. Buffer is reused as long as it holds the current value. */
+typedef struct {
+    PyObject_HEAD
+    char *name;
+    char *buf;
+    Py_ssize_t len;
+    int exports;
+} ScalarViewObject;
+
+static PyTypeObject ScalarViewType;
+
+/* Returns 1 if metafied s is the value kept in the view buffer. Runs between 
+ * Meta bytes are compared with memcmp. */
+static int
+scalar_view_current(ScalarViewObject *self, const char *s)
+{
+    const char *p = self->buf, *e = self->buf + self->len, *m;
+    size_t n;
+
+    if (!p)
+	return 0;
+    for (;;) {
+	m = strchr(s, Meta);
+	n = m ? (size_t) (m - s) : strlen(s);
+	if ((size_t) (e - p) < n || memcmp(s, p, n))
+	    return 0;
+	p += n;
+	if (!m)
+	    return p == e;
+	if (p == e || (char) (m[1] ^ 32) != *p)
+	    return 0;
+	s = m + 2;
+	p++;
+    }
+}
+
+static int
+ScalarViewGetBuffer(ScalarViewObject *self, Py_buffer *view, int flags)
+{
+    const struct meta_kernel *kernel = get_meta_kernel();
+    size_t len, nmeta;
+    Param pm;
+    char *s;
+
+    if (check_main_thread())
+	return -1;
+    if (flags & PyBUF_WRITABLE) {
+	PyErr_SetString(PyExc_BufferError, "Scalar view is read-only");
+	return -1;
+    }
+    if (!(pm = (Param) paramtab->getnode(paramtab, self->name))
+	    || (pm->node.flags & PM_UNSET)) {
+	PyErr_Format(PyExc_KeyError, "Parameter %s no longer exists",
+		self->name);
+	return -1;
+    }
+    if (PM_TYPE(pm->node.flags) != PM_SCALAR) {
+	PyErr_Format(PyExc_TypeError, "Parameter %s is no longer a scalar",
+		self->name);
+	return -1;
+    }
+
+    s = pm->gsu.s->getfn(pm);
+    if (!scalar_view_current(self, s)) {
+	/* Memory of exported buffer must stay as it is */
+	if (self->exports) {
+	    PyErr_Format(PyExc_BufferError,
+		    "Parameter %s changed while its buffer is exported",
+		    self->name);
+	    return -1;
+	}
+	PyMem_Free(self->buf);
+	self->buf = NULL;
+	len = strlen(s);
+	nmeta = kernel->count_meta(s, len);
+	if (!(self->buf = PyMem_Malloc(len - nmeta + 1))) {
+	    PyErr_NoMemory();
+	    return -1;
+	}
+	if (nmeta)
+	    kernel->unmeta(self->buf, s, len);
+	else
+	    memcpy(self->buf, s, len);
+	self->len = (Py_ssize_t) (len - nmeta);
+    }
+
+    if (PyBuffer_FillInfo(view, (PyObject *) self, self->buf, self->len, 1,
+		flags) == -1)
+	return -1;
+    self->exports++;
+    return 0;
+}
+
+static void
+ScalarViewReleaseBuffer(ScalarViewObject *self, UNUSED(Py_buffer *view))
+{
+    self->exports--;
+}
+
+static void
+ScalarViewDealloc(ScalarViewObject *self)
+{
+    PyMem_Free(self->buf);
+    zsfree(self->name);
+    PyObject_Del(self);
+}
+
+static PyBufferProcs ScalarViewAsBuffer;
+
+static PyObject *
+new_scalar_view(char *name)
+{
+    ScalarViewObject *view;
+
+    if (!(view = PyObject_NEW(ScalarViewObject, &ScalarViewType)))
+	return NULL;
+    view->name = ztrdup(name);
+    view->buf = NULL;
+    view->len = 0;
+    view->exports = 0;
+    return (PyObject *) view;
+}
+
+static PyObject *
+ZshGetView(UNUSED(PyObject *self), PyObject *args)
+{
+    HashViewObject *view;
+    char *name = NULL;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTuple(args, "|s", &name))
+	return NULL;
+
+    if (name) {
+	Param pm;
+
+	if (!isident(name)) {
+	    PyErr_SetString(PyExc_KeyError,
+		    "Parameter name is not an identifier");
+	    return NULL;
+	}
+	if (!(pm = (Param) paramtab->getnode(paramtab, name))
+		|| (pm->node.flags & PM_UNSET)) {
+	    PyErr_SetString(PyExc_IndexError, "Failed to find parameter");
+	    return NULL;
+	}
+	if (PM_TYPE(pm->node.flags) == PM_SCALAR)
+	    return new_scalar_view(name);
+	if (PM_TYPE(pm->node.flags) == PM_ARRAY)
+	    return new_array_view(name, pm);
+	if (PM_TYPE(pm->node.flags) != PM_HASHED) {
+	    PyErr_SetString(PyExc_TypeError, "Views are only supported for "
+		    "scalars, arrays and associative arrays");
+	    return NULL;
+	}
+    }
+
+    if (!(view = PyObject_NEW(HashViewObject, &HashViewType)))
+	return NULL;
+    view->name = name ? ztrdup(name) : NULL;
+    return (PyObject *) view;
+}
+
+/* Returns new reference to the object holding value of special parameter */
+static PyObject *
+get_special_object(struct special_data *data)
+{
+    if (data->cache == SPECIAL_CACHE_ASYNC)
+	return get_async_value(data);
+    if (data->type == PM_ARRAY) {
+	Py_INCREF(data->obj);
+	return data->obj;
+    }
+    return special_snapshot(data->type, data->obj);
+}
+
+static void
+unset_special_parameter(struct special_data *data)
+{
+    special_cache_clear(data);
+    Py_XDECREF(data->cell);
+    Py_XDECREF(data->on_update);
+    Py_DECREF(data->obj);
+    free_sp(data->sp);
+    PyMem_Free(data);
+}
+
+
+#define ZFAIL(errargs, failval) \
+    PyErr_PrintEx(0); \
+    PYTHON_FINISH; \
+    zerr errargs; \
+    return failval
+
+#define ZFAIL_NOFINISH(errargs, failval) \
+    PyErr_PrintEx(0); \
+    flush_io(); \
+    zerr errargs; \
+    return failval
+
+struct sh_keyobj_data {
+    PyObject *obj;
+    PyObject *keyobj;
+    /* Value converted while scanning, NULL if it was not requested */
+    char *value;
+};
+
+struct sh_key_data {
+    PyObject *obj;
+    char *key;
+};
+
+/* Returns heap string for value object, NULL with exception set on error */
+static char *
+get_sh_value_chars(PyObject *valobj)
+{
+    PyObject *string;
+    char *str;
+
+    if (IS_PY_STRING(valobj))
+	return get_chars(valobj, zhalloc);
+    if (!(string = PyObject_Str(valobj)))
+	return NULL;
+    str = get_chars(string, zhalloc);
+    Py_DECREF(string);
+    return str;
+}
+
+static char *
+get_sh_item_value(PyObject *obj, PyObject *keyobj)
+{
+    PyObject *valobj, *string;
+    char *str;
+
+    if (!(valobj = PyObject_GetItem(obj, keyobj))) {
+	if (PyErr_Occurred()) {
+	    /* Expected result: key not found */
+	    if (PyErr_ExceptionMatches(PyExc_KeyError)) {
+		PyErr_Clear();
+		return dupstring("");
+	    }
+	    /* Unexpected result: unknown exception */
+	    else
+		ZFAIL_NOFINISH(("Failed to get value object"), dupstring(""));
+	}
+	else
+	    return dupstring("");
+    }
+
+    if (IS_PY_STRING(valobj))
+	string = valobj;
+    else {
+	if (!(string = PyObject_Str(valobj))) {
+	    ZFAIL_NOFINISH(("Failed to get value string object"), dupstring(""));
+	}
+	Py_DECREF(valobj);
+    }
+
+    if (!(str = get_chars(string, zhalloc))) {
+	Py_DECREF(string);
+	ZFAIL_NOFINISH(("Failed to get string from value string object"),
+		dupstring(""));
+    }
+    Py_DECREF(string);
+    return str;
+}
+
+static char *
+get_sh_keyobj_value(Param pm)
+{
+    struct sh_keyobj_data *sh_kodata = (struct sh_keyobj_data *) pm->u.data;
+    if (sh_kodata->value)
+	return sh_kodata->value;
+    return get_sh_item_value(sh_kodata->obj, sh_kodata->keyobj);
+}
+
+static char *
+get_sh_key_value(Param pm)
+{
+    char *r, *key;
+    PyObject *keyobj, *obj;
+    struct sh_key_data *sh_kdata = (struct sh_key_data *) pm->u.data;
+
+    PYTHON_INIT(dupstring(""));
+
+    obj = sh_kdata->obj;
+    key = sh_kdata->key;
+
+    if (!(keyobj = get_string(key))) {
+	ZFAIL(("Failed to create key string object for key \"%s\"", key),
+		dupstring(""));
+    }
+    r = get_sh_item_value(obj, keyobj);
+    Py_DECREF(keyobj);
+
+    PYTHON_FINISH;
+    return r;
+}
+
+static void
+set_sh_item_value(PyObject *obj, PyObject *keyobj, char *val)
+{
+    PyObject *valobj;
+
+    if (!(valobj = get_string(val))) {
+	ZFAIL_NOFINISH(("Failed to create value string object"), );
+    }
+
+    if (PyObject_SetItem(obj, keyobj, valobj) == -1) {
+	Py_DECREF(valobj);
+	ZFAIL_NOFINISH(("Failed to set object to \"%s\"", val), );
+    }
+    Py_DECREF(valobj);
+}
+
+static void
+set_sh_key_value(Param pm, char *val)
+{
+    PyObject *obj, *keyobj;
+    char *key;
+    struct sh_key_data *sh_kdata = (struct sh_key_data *) pm->u.data;
+
+    PYTHON_INIT();
+
+    obj = sh_kdata->obj;
+    key = sh_kdata->key;
+
+    if (!(keyobj = get_string(key))) {
+	ZFAIL(("Failed to create key string object for key \"%s\"", key), );
+    }
+    set_sh_item_value(obj, keyobj, val);
+    Py_DECREF(keyobj);
+
+    PYTHON_FINISH;
+}
+
+static void
+set_sh_keyobj_value(Param pm, char *val)
+{
+    struct sh_keyobj_data *sh_kodata = (struct sh_keyobj_data *) pm->u.data;
+    sh_kodata->value = NULL;
+    set_sh_item_value(sh_kodata->obj, sh_kodata->keyobj, val);
+}
+
+static struct gsu_scalar sh_keyobj_gsu =
+{get_sh_keyobj_value, set_sh_keyobj_value, nullunsetfn};
+static struct gsu_scalar sh_key_gsu =
+{get_sh_key_value, set_sh_key_value, nullunsetfn};
+
+static HashNode
+get_sh_item(HashTable ht, const char *key)
+{
+    PyObject *obj = ((struct obj_hash_node *) (*ht->nodes))->obj;
+    Param pm;
+    struct sh_key_data *sh_kdata;
+
+    PYTHON_INIT(NULL);
+
+    pm = (Param) hcalloc(sizeof(struct param));
+    pm->node.nam = dupstring(key);
+    pm->node.flags = PM_SCALAR;
+    pm->gsu.s = &sh_key_gsu;
+
+    sh_kdata = (struct sh_key_data *) hcalloc(sizeof(struct sh_key_data) * 1);
+    sh_kdata->obj = obj;
+    sh_kdata->key = dupstring(key);
+
+    pm->u.data = (void *) sh_kdata;
+
+    PYTHON_FINISH;
+
+    return &pm->node;
+}
+
+/* Passes one entry to scan function. Value object is only given when values 
+ * were requested: it is then converted once here instead of being looked up 
+ * again by sh_keyobj_gsu. */
+static int
+scan_sh_entry(PyObject *obj, PyObject *keyobj, PyObject *valobj,
+	ScanFunc func, int flags)
+{
+    struct param pm;
+    struct sh_keyobj_data sh_kodata;
+
+    if (!IS_PY_STRING(keyobj)) {
+	ZFAIL_NOFINISH(("Key is not a string"), -1);
+    }
+
+    memset((void *) &pm, 0, sizeof(struct param));
+    pm.node.flags = PM_SCALAR;
+    pm.gsu.s = &sh_keyobj_gsu;
+
+    if (!(pm.node.nam = get_chars(keyobj, zhalloc))) {
+	ZFAIL_NOFINISH(("Failed to get string from key string object"), -1);
+    }
+
+    sh_kodata.obj = obj;
+    sh_kodata.keyobj = keyobj;
+    sh_kodata.value = NULL;
+    if (valobj && !(sh_kodata.value = get_sh_value_chars(valobj))) {
+	ZFAIL_NOFINISH(("Failed to get string from value object"), -1);
+    }
+    pm.u.data = (void *) &sh_kodata;
+
+    func(&pm.node, flags);
+    return 0;
+}
+
+static void
+scan_special_hash(HashTable ht, ScanFunc func, int flags)
+{
+    PyObject *obj = ((struct obj_hash_node *) (*ht->nodes))->obj;
+    PyObject *iter, *keyobj, *valobj, *items = NULL;
+    int wantvals = flags & SCANPM_WANTVALS;
+    int r;
+
+    PYTHON_INIT();
+
+    /* Subclasses may override __getitem__ which neither PyDict_Next nor 
+     * dict.items() call: their values are looked up by key */
+    if (PyDict_CheckExact(obj)) {
+	Py_ssize_t pos = 0;
+
+	while (PyDict_Next(obj, &pos, &keyobj, &valobj)) {
+	    /* Entries are borrowed: value conversion may run Python code */
+	    Py_INCREF(keyobj);
+	    Py_INCREF(valobj);
+	    r = scan_sh_entry(obj, keyobj, wantvals ? valobj : NULL,
+		    func, flags);
+	    Py_DECREF(valobj);
+	    Py_DECREF(keyobj);
+	    if (r)
+		break;
+	}
+	PYTHON_FINISH;
+	return;
+    }
+
+    if (wantvals && !PyDict_Check(obj) && !(items = PyMapping_Items(obj))) {
+	/* Not a mapping with items(): values are looked up by key */
+	if (!PyErr_ExceptionMatches(PyExc_AttributeError)) {
+	    ZFAIL(("Failed to get mapping items"), );
+	}
+	PyErr_Clear();
+    }
+
+    if (!(iter = PyObject_GetIter(items ? items : obj))) {
+	Py_XDECREF(items);
+	ZFAIL(("Failed to get iterator"), );
+    }
+
+    while ((keyobj = PyIter_Next(iter))) {
+	if (items) {
+	    PyObject *item = keyobj;
+
+	    if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+		Py_DECREF(item);
+		zerr("items() must return (key, value) pairs");
+		break;
+	    }
+	    r = scan_sh_entry(obj, PyTuple_GET_ITEM(item, 0),
+		    PyTuple_GET_ITEM(item, 1), func, flags);
+	}
+	else
+	    r = scan_sh_entry(obj, keyobj, NULL, func, flags);
+	Py_DECREF(keyobj);
+	if (r)
+	    break;
+    }
+    Py_DECREF(iter);
+    Py_XDECREF(items);
+
+    PYTHON_FINISH;
+}
+
+static char *
+get_special_string(Param pm)
+{
+    struct special_data *data = (struct special_data *) pm->u.data;
+    PyObject *robj;
+    char *r;
+
+    if (data->cache == SPECIAL_CELL)
+	return cell_get_string((CellObject *) data->obj);
+    if (special_cache_valid(data))
+	return dupstring(data->value.str);
+
+    PYTHON_INIT(dupstring(""));
+
+    if (!(robj = get_special_object(data))) {
+	ZFAIL(("Failed to create string object for parameter %s",
+		    pm->node.nam), dupstring(""));
+    }
+
+    if (!(r = get_chars(robj, zhalloc))) {
+	ZFAIL(("Failed to transform value for parameter %s", pm->node.nam),
+		dupstring(""));
+    }
+
+    Py_DECREF(robj);
+
+    if (special_cache_memoized(data)) {
+	special_cache_clear(data);
+	data->value.str = ztrdup(r);
+	special_cache_stored(data);
+    }
+
+    PYTHON_FINISH;
+
+    return r;
+}
+
+static zlong
+get_special_integer(Param pm)
+{
+    struct special_data *data = (struct special_data *) pm->u.data;
+    PyObject *robj;
+    zlong r;
+
+    if (data->cache == SPECIAL_CELL)
+	return cell_get_integer((CellObject *) data->obj);
+    if (special_cache_valid(data))
+	return data->value.i;
+
+    PYTHON_INIT(0);
+
+    if (!(robj = get_special_object(data))) {
+	ZFAIL(("Failed to create int object for parameter %s", pm->node.nam),
+		0);
+    }
+
+    r = PyLong_AsLong(robj);
+
+    Py_DECREF(robj);
+
+    if (special_cache_memoized(data)) {
+	data->value.i = r;
+	special_cache_stored(data);
+    }
+
+    PYTHON_FINISH;
+
+    return r;
+}
+
+static double
+get_special_float(Param pm)
+{
+    struct special_data *data = (struct special_data *) pm->u.data;
+    PyObject *robj;
+    float r;
+
+    if (data->cache == SPECIAL_CELL)
+	return cell_get_float((CellObject *) data->obj);
+    if (special_cache_valid(data))
+	return data->value.f;
+
+    PYTHON_INIT(0.0);
+
+    if (!(robj = get_special_object(data))) {
+	ZFAIL(("Failed to create float object for parameter %s", pm->node.nam),
+		0);
+    }
+
+    r = PyFloat_AsDouble(robj);
+
+    Py_DECREF(robj);
+
+    if (special_cache_memoized(data)) {
+	data->value.f = r;
+	special_cache_stored(data);
+    }
+
+    PYTHON_FINISH;
+
+    return r;
+}
+
+static char **
+get_special_array(Param pm)
+{
+    struct special_data *data = (struct special_data *) pm->u.data;
+    PyObject *robj;
+    char **r;
+
+    if (special_cache_valid(data))
+	return arrdup(data->value.arr);
+
+    PYTHON_INIT(hcalloc(sizeof(char **)));
+
+    if (!(robj = get_special_object(data))) {
+	ZFAIL(("Failed to create array object for parameter %s", pm->node.nam),
+		hcalloc(sizeof(char **)));
+    }
+
+    r = get_chars_array(robj, zhalloc, NULL);
+    Py_DECREF(robj);
+    if (!r) {
+	ZFAIL(("Failed to create array object for parameter %s", pm->node.nam),
+		hcalloc(sizeof(char **)));
+    }
+
+    if (special_cache_memoized(data)) {
+	special_cache_clear(data);
+	data->value.arr = zarrdup(r);
+	special_cache_stored(data);
+    }
+
+    PYTHON_FINISH;
+
+    return r;
+}
+
+static void
+set_special_string(Param pm, char *val)
+{
+    PyObject *r, *args;
+
+    PYTHON_INIT();
+
+    if (!val) {
+	unset_special_parameter((struct special_data *) pm->u.data);
+
+	PYTHON_FINISH;
+	return;
+    }
+
+    args = Py_BuildValue("(O&)", get_string, val);
+    r = PyObject_CallObject(((struct special_data *) pm->u.data)->obj, args);
+    Py_DECREF(args);
+    if (!r) {
+	PyErr_PrintEx(0);
+	zerr("Failed to assign value for string parameter %s", pm->node.nam);
+	PYTHON_FINISH;
+	return;
+    }
+    Py_DECREF(r);
+    special_invalidate((struct special_data *) pm->u.data);
+
+    PYTHON_FINISH;
+}
+
+static void
+set_special_integer(Param pm, zlong val)
+{
+    PyObject *r, *args;
+
+    PYTHON_INIT();
+
+    args = Py_BuildValue("(L)", (long long) val);
+    r = PyObject_CallObject(((struct special_data *) pm->u.data)->obj, args);
+    Py_DECREF(args);
+    if (!r) {
+	PyErr_PrintEx(0);
+	zerr("Failed to assign value for integer parameter %s", pm->node.nam);
+	PYTHON_FINISH;
+	return;
+    }
+    Py_DECREF(r);
+    special_invalidate((struct special_data *) pm->u.data);
+
+    PYTHON_FINISH;
+}
+
+static void
+set_special_float(Param pm, double val)
+{
+    PyObject *r, *args;
+
+    PYTHON_INIT();
+
+    args = Py_BuildValue("(d)", val);
+    r = PyObject_CallObject(((struct special_data *) pm->u.data)->obj, args);
+    Py_DECREF(args);
+    if (!r) {
+	PyErr_PrintEx(0);
+	zerr("Failed to assign value for float parameter %s", pm->node.nam);
+	PYTHON_FINISH;
+	return;
+    }
+    Py_DECREF(r);
+    special_invalidate((struct special_data *) pm->u.data);
+
+    PYTHON_FINISH;
+}
+
+static void
+set_special_array(Param pm, char **val)
+{
+    PyObject *r, *args;
+
+    PYTHON_INIT();
+
+    if (!val) {
+	unset_special_parameter((struct special_data *) pm->u.data);
+
+	PYTHON_FINISH;
+	return;
+    }
+
+    args = Py_BuildValue("(O&)", get_array, val);
+    r = PyObject_CallObject(((struct special_data *) pm->u.data)->obj, args);
+    Py_DECREF(args);
+    if (!r) {
+	PyErr_PrintEx(0);
+	zerr("Failed to assign value for array parameter %s", pm->node.nam);
+	PYTHON_FINISH;
+	return;
+    }
+    Py_DECREF(r);
+    special_invalidate((struct special_data *) pm->u.data);
+
+    PYTHON_FINISH;
+}
+
+static void
+set_special_hash(Param pm, HashTable ht)
+{
+    int i;
+    HashNode hn;
+    PyObject *obj = ((struct obj_hash_node *) (*pm->u.hash->nodes))->obj;
+    PyObject *keys, *iter, *keyobj;
+
+    if (pm->u.hash == ht)
+	return;
+
+    PYTHON_INIT();
+
+    if (!ht) {
+	struct specialparam *sp =
+	    ((struct obj_hash_node *) (*pm->u.hash->nodes))->sp;
+	free_sp(sp);
+	Py_DECREF(obj);
+	PYTHON_FINISH;
+	return;
+    }
+
+    /* Can't use PyObject_GetIter on the object itself: it fails if object is 
+     * being modified */
+    if (!(keys = PyMapping_Keys(obj))) {
+	ZFAIL(("Failed to get object keys"), );
+    }
+    if (!(iter = PyObject_GetIter(keys))) {
+	ZFAIL(("Failed to get keys iterator"), );
+    }
+    while ((keyobj = PyIter_Next(iter))) {
+	if (PyMapping_DelItem(obj, keyobj) == -1) {
+	    ZFAIL(("Failed to delete some key"), );
+	}
+	Py_DECREF(keyobj);
+    }
+    Py_DECREF(iter);
+    Py_DECREF(keys);
+
+    for (i = 0; i < ht->hsize; i++)
+	for (hn = ht->nodes[i]; hn; hn = hn->next) {
+	    struct value v;
+	    char *val;
+	    PyObject *valobj, *keyobj;
+
+	    v.isarr = v.flags = v.start = 0;
+	    v.end = -1;
+	    v.arr = NULL;
+	    v.pm = (Param) hn;
+
+	    val = getstrvalue(&v);
+	    if (!val) {
+		ZFAIL(("Failed to get string value"), );
+	    }
+
+	    if (!(valobj = get_string(val))) {
+		ZFAIL(("Failed to convert value \"%s\" to string object "
+			    "while processing key", val, hn->nam), );
+	    }
+	    if (!(keyobj = get_string(hn->nam))) {
+		Py_DECREF(valobj);
+		ZFAIL(("Failed to convert key \"%s\" to string object",
+			    hn->nam), );
+	    }
+
+	    if (PyObject_SetItem(obj, keyobj, valobj) == -1) {
+		Py_DECREF(valobj);
+		Py_DECREF(keyobj);
+		ZFAIL(("Failed to set key %s", hn->nam), );
+	    }
+
+	    Py_DECREF(valobj);
+	    Py_DECREF(keyobj);
+	}
+    PYTHON_FINISH;
+}
+
+static void
+unsetfn(Param pm, int exp)
+{
+    PYTHON_INIT();
+    unset_special_parameter((struct special_data *) pm->u.data);
+    PYTHON_FINISH;
+    stdunsetfn(pm, exp);
+}
+
+static void
+free_sh_node(HashNode nodeptr)
+{
+    /* Param is obtained from get_sh_item */
+    Param pm = (Param) nodeptr;
+    struct sh_key_data *sh_kdata = (struct sh_key_data *) pm->u.data;
+    PyObject *keyobj;
+
+    PYTHON_INIT();
+
+    if (!(keyobj = get_string(sh_kdata->key))) {
+	ZFAIL(("While unsetting key %s of parameter %s failed to get "
+		    "key string object", sh_kdata->key, pm->node.nam), );
+    }
+    if (PyMapping_DelItem(sh_kdata->obj, keyobj) == -1) {
+	Py_DECREF(keyobj);
+	ZFAIL(("Failed to delete key %s of parameter %s",
+		    sh_kdata->key, pm->node.nam), );
+    }
+    Py_DECREF(keyobj);
+
+    PYTHON_FINISH;
+}
+
+static const struct gsu_scalar special_string_gsu =
+{get_special_string, set_special_string, stdunsetfn};
+static const struct gsu_integer special_integer_gsu =
+{get_special_integer, set_special_integer, unsetfn};
+static const struct gsu_float special_float_gsu =
+{get_special_float, set_special_float, unsetfn};
+static const struct gsu_array special_array_gsu =
+{get_special_array, set_special_array, stdunsetfn};
+static const struct gsu_hash special_hash_gsu =
+{hashgetfn, set_special_hash, stdunsetfn};
+
+static int
+check_special_name(char *name)
+{
+    /* Needing strncasecmp, but the one that ignores locale */
+    if (!(         (name[0] == 'z' || name[0] == 'Z')
+		&& (name[1] == 'p' || name[1] == 'P')
+		&& (name[2] == 'y' || name[2] == 'Y')
+		&& (name[3] == 't' || name[3] == 'T')
+		&& (name[4] == 'h' || name[4] == 'H')
+		&& (name[5] == 'o' || name[5] == 'O')
+		&& (name[6] == 'n' || name[6] == 'N')
+		&& (name[7] != '\0')
+       ) || !isident(name))
+    {
+	PyErr_SetString(PyExc_KeyError, "Invalid special identifier: "
+		"it must be a valid variable name starting with "
+		"\"zpython\" (ignoring case) and containing at least one more "
+		"character");
+	return 1;
+    }
+    return 0;
+}
+
+/* Parses cache argument of zsh.set_special_*: None or False disable caching, 
+ * True caches value until it is invalidated, number is a TTL in seconds, 
+ * "prompt" caches value until next precmd and "async" makes parameter 
+ * asynchronous */
+static int
+get_cache_mode(PyObject *cache, double *ttl)
+{
+    if (!cache || cache == Py_None || cache == Py_False)
+	return SPECIAL_CACHE_NONE;
+    if (cache == Py_True)
+	return SPECIAL_CACHE_MANUAL;
+    if (PyNumber_Check(cache) && !IS_PY_STRING(cache)) {
+	if ((*ttl = PyFloat_AsDouble(cache)) == -1.0 && PyErr_Occurred())
+	    return -1;
+	if (*ttl <= 0) {
+	    PyErr_SetString(PyExc_ValueError, "Cache TTL must be positive");
+	    return -1;
+	}
+	return SPECIAL_CACHE_TTL;
+    }
+    if (IS_PY_STRING(cache)) {
+	char *mode;
+
+	if (!(mode = get_chars(cache, PyMem_Malloc)))
+	    return -1;
+	if (!strcmp(mode, "prompt")) {
+	    PyMem_Free(mode);
+	    return SPECIAL_CACHE_PROMPT;
+	}
+	if (!strcmp(mode, "async")) {
+	    PyMem_Free(mode);
+	    return SPECIAL_CACHE_ASYNC;
+	}
+	PyMem_Free(mode);
+    }
+    PyErr_SetString(PyExc_ValueError, "Cache must be None, bool, "
+	    "number of seconds, \"prompt\" or \"async\"");
+    return -1;
+}
+
+static PyObject *
+set_special_parameter(PyObject *args, PyObject *kwargs, int type)
+{
+    static char *kwlist[] = {"name", "value", "cache", "on_update", NULL};
+    char *name;
+    PyObject *obj, *cache = NULL, *on_update = NULL, *cell = NULL;
+    Param pm;
+    int flags = type;
+    int cache_mode;
+    double ttl = 0;
+    struct special_data *data;
+    struct specialparam *sp;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sO|OO", kwlist,
+		&name, &obj, &cache, &on_update))
+	return NULL;
+
+    if (check_special_name(name))
+	return NULL;
+
+    if ((cache_mode = get_cache_mode(cache, &ttl)) == -1)
+	return NULL;
+    if (PyObject_TypeCheck(obj, &CellType)) {
+	int cell_type = ((CellObject *) obj)->type;
+
+	if (cache_mode != SPECIAL_CACHE_NONE) {
+	    PyErr_SetString(PyExc_ValueError,
+		    "Cells do not support caching");
+	    return NULL;
+	}
+	if (cell_type != (type == PM_FFLOAT ? PM_EFLOAT : type)) {
+	    PyErr_SetString(PyExc_TypeError,
+		    "Cell value type does not match parameter type");
 	    return NULL;
 	}
+	cache_mode = SPECIAL_CELL;
+    }
+    if (cache_mode != SPECIAL_CACHE_NONE && type == PM_HASHED) {
+	PyErr_SetString(PyExc_ValueError,
+		"Caching is not supported for special hashes");
+	return NULL;
+    }
+    if (on_update == Py_None)
+	on_update = NULL;
+    if (on_update && cache_mode != SPECIAL_CACHE_ASYNC) {
+	PyErr_SetString(PyExc_ValueError,
+		"on_update is only supported with cache=\"async\"");
+	return NULL;
+    }
+    if (on_update && !PyCallable_Check(on_update)) {
+	PyErr_SetString(PyExc_TypeError, "on_update must be callable");
+	return NULL;
     }
-    else if (PyDict_Check(value)) {
-	char **val, **valstart;
-	PyObject *pkey, *pval;
-	Py_ssize_t arrlen, pos = 0;
 
-	arrlen = (2 * PyDict_Size(value) + 1) * sizeof(char *);
-	val = (char **) zalloc(arrlen);
-	valstart = val;
+    switch (type) {
+    case PM_SCALAR:
+	break;
+    case PM_INTEGER:
+    case PM_EFLOAT:
+    case PM_FFLOAT:
+	if (!PyNumber_Check(obj) && cache_mode != SPECIAL_CELL) {
+	    PyErr_SetString(PyExc_TypeError,
+		    "Object must implement numeric protocol");
+	    return NULL;
+	}
+	break;
+    case PM_ARRAY:
+	if (!PySequence_Check(obj)) {
+	    PyErr_SetString(PyExc_TypeError,
+		    "Object must implement sequence protocol");
+	    return NULL;
+	}
+	break;
+    case PM_HASHED:
+	if (!PyMapping_Check(obj)) {
+	    PyErr_SetString(PyExc_TypeError,
+		    "Object must implement mapping protocol");
+	    return NULL;
+	}
+	break;
+    }
+
+    if (cache_mode == SPECIAL_CACHE_ASYNC
+	    && !(cell = Py_BuildValue("[OO]", Py_None, Py_False)))
+	return NULL;
+
+    if (type == PM_HASHED) {
+	if (!(pm = createspecialhash(name, get_sh_item,
+				    scan_special_hash, flags))) {
+	    PyErr_SetString(PyExc_RuntimeError, "Failed to create parameter");
+	    return NULL;
+	}
+    }
+    else {
+	if (!(pm = createparam(name, flags))) {
+	    PyErr_SetString(PyExc_RuntimeError, "Failed to create parameter");
+	    Py_XDECREF(cell);
+	    return NULL;
+	}
+    }
+
+    sp = PyMem_New(struct specialparam, 1);
+    sp->prev = last_assigned_param;
+    if (last_assigned_param)
+	last_assigned_param->next = sp;
+    else
+	first_assigned_param = sp;
+    last_assigned_param = sp;
+    sp->next = NULL;
+    sp->name = ztrdup(name);
+    sp->pm = pm;
+
+    if (type != PM_HASHED) {
+	data = PyMem_New(struct special_data, 1);
+	data->sp = sp;
+	data->obj = obj;
+	Py_INCREF(obj);
+	data->type = PM_TYPE(flags);
+	data->cache = cache_mode;
+	data->cached = 0;
+	data->ttl = ttl;
+	data->cell = cell;
+	data->on_update = on_update;
+	Py_XINCREF(on_update);
+	pm->u.data = data;
+
+	if (cache_mode == SPECIAL_CACHE_PROMPT
+		|| cache_mode == SPECIAL_CACHE_ASYNC)
+	    install_prompt_hook();
+    }
+
+    pm->level = 0;
+
+    switch (type) {
+    case PM_SCALAR:
+	pm->gsu.s = &special_string_gsu;
+	break;
+    case PM_INTEGER:
+	pm->gsu.i = &special_integer_gsu;
+	break;
+    case PM_EFLOAT:
+    case PM_FFLOAT:
+	pm->gsu.f = &special_float_gsu;
+	break;
+    case PM_ARRAY:
+	pm->gsu.a = &special_array_gsu;
+	break;
+    case PM_HASHED:
+	{
+	    struct obj_hash_node *ohn;
+	    HashTable ht = pm->u.hash;
+	    ohn = PyMem_New(struct obj_hash_node, 1);
+	    ohn->nam = ztrdup("obj");
+	    ohn->obj = obj;
+	    Py_INCREF(obj);
+	    ohn->sp = sp;
+	    zfree(ht->nodes, ht->hsize * sizeof(HashNode));
+	    ht->nodes = (HashNode *) zshcalloc(1 * sizeof(HashNode));
+	    ht->hsize = 1;
+	    *ht->nodes = (struct hashnode *) ohn;
+	    pm->gsu.h = &special_hash_gsu;
+	    ht->freenode = free_sh_node;
+	    break;
+	}
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ZshSetMagicString(UNUSED(PyObject *self), PyObject *args, PyObject *kwargs)
+{
+    if (check_main_thread())
+	return NULL;
+
+    return set_special_parameter(args, kwargs, PM_SCALAR);
+}
+
+static PyObject *
+ZshSetMagicInteger(UNUSED(PyObject *self), PyObject *args, PyObject *kwargs)
+{
+    if (check_main_thread())
+	return NULL;
+
+    return set_special_parameter(args, kwargs, PM_INTEGER);
+}
+
+static PyObject *
+ZshSetMagicFloat(UNUSED(PyObject *self), PyObject *args, PyObject *kwargs)
+{
+    if (check_main_thread())
+	return NULL;
+
+    return set_special_parameter(args, kwargs, PM_EFLOAT);
+}
+
+static PyObject *
+ZshSetMagicArray(UNUSED(PyObject *self), PyObject *args, PyObject *kwargs)
+{
+    if (check_main_thread())
+	return NULL;
+
+    return set_special_parameter(args, kwargs, PM_ARRAY);
+}
+
+static PyObject *
+ZshSetMagicHash(UNUSED(PyObject *self), PyObject *args, PyObject *kwargs)
+{
+    if (check_main_thread())
+	return NULL;
 
-	while (PyDict_Next(value, &pos, &pkey, &pval)) {
-	    if (!IS_PY_STRING(pkey)) {
-		PyErr_SetString(PyExc_TypeError,
-			"Only string keys are allowed");
-		FAIL_SETTING_ARRAY(val, arrlen, zfree);
-	    }
-	    if (!IS_PY_STRING(pval)) {
-		PyErr_SetString(PyExc_TypeError,
-			"Only string values are allowed");
-		FAIL_SETTING_ARRAY(val, arrlen, zfree);
-	    }
+    return set_special_parameter(args, kwargs, PM_HASHED);
+}
 
-	    if (!(*val++ = get_chars(pkey, zalloc))) {
-		FAIL_SETTING_ARRAY(val, arrlen, zfree);
-	    }
-	    if (!(*val++ = get_chars(pval, zalloc))) {
-		FAIL_SETTING_ARRAY(val, arrlen, zfree);
-	    }
-	}
-	*val = NULL;
+static PyObject *
+ZshInvalidate(UNUSED(PyObject *self), PyObject *args)
+{
+    char *name = NULL;
+    struct specialparam *sp;
 
-	if (!sethparam(name, valstart)) {
-	    PyErr_SetString(PyExc_RuntimeError, "Failed to set hash");
-	    return NULL;
-	}
-    }
-    /* Python's list have no faster shortcut methods like PyDict_Next above 
-     * thus using more abstract protocol */
-    else if (PySequence_Check(value)) {
-	char **ss = get_chars_array(value, zalloc, zfree);
+    if (check_main_thread())
+	return NULL;
 
-	if (!ss)
-	    return NULL;
+    if (!PyArg_ParseTuple(args, "|s", &name))
+	return NULL;
 
-	if (!setaparam(name, ss)) {
-	    PyErr_SetString(PyExc_RuntimeError, "Failed to set array");
-	    return NULL;
-	}
-    }
-    else if (value == Py_None) {
-	unsetparam(name);
-	if (errflag) {
-	    PyErr_SetString(PyExc_RuntimeError, "Failed to delete parameter");
-	    return NULL;
-	}
+    for (sp = first_assigned_param; sp; sp = sp->next) {
+	if (name && strcmp(sp->name, name))
+	    continue;
+	if (PM_TYPE(sp->pm->node.flags) != PM_HASHED)
+	    special_invalidate((struct special_data *) sp->pm->u.data);
+	if (name)
+	    Py_RETURN_NONE;
     }
-    else {
-	PyErr_SetString(PyExc_TypeError,
-		"Cannot assign value of the given type");
+
+    if (name) {
+	PyErr_Format(PyExc_KeyError, "Special parameter %s does not exist",
+		name);
 	return NULL;
     }
 
@@ -590,758 +5230,1468 @@ ZshSetValue(UNUSED(PyObject *self), PyObject *args)
 }
 
 static PyObject *
-ZshExitCode(UNUSED(PyObject *self), UNUSED(PyObject *args))
+ZshTimings(UNUSED(PyObject *self), UNUSED(PyObject *args))
 {
-    return PyLong_FromLong((long) lastval);
+    PyObject *r, *hooks;
+
+    if (!(hooks = get_hook_timings()))
+	return NULL;
+
+    r = Py_BuildValue("{s:d,s:O,s:d,s:N}",
+	    "init", init_time,
+	    "lazy", lazy_boot ? Py_True : Py_False,
+	    "preload_wait", preload_wait,
+	    "hooks", hooks);
+    if (!r)
+	return NULL;
+
+    if (preload_info && PyDict_Update(r, preload_info) == -1) {
+	Py_DECREF(r);
+	return NULL;
+    }
+
+    return r;
 }
 
 static PyObject *
-ZshColumns(UNUSED(PyObject *self), UNUSED(PyObject *args))
+ZshMetaKernel(UNUSED(PyObject *self), PyObject *args)
 {
-    return PyLong_FromLong((long) zterm_columns);
+    char *name = NULL;
+
+    if (!PyArg_ParseTuple(args, "|s", &name))
+	return NULL;
+
+    if (name) {
+	const struct meta_kernel *kernel;
+
+	for (kernel = meta_kernels; kernel->name; kernel++)
+	    if (!strcmp(kernel->name, name))
+		break;
+	if (!kernel->name || !meta_kernel_supported(kernel)) {
+	    PyErr_Format(PyExc_ValueError, "Kernel %s is not supported", name);
+	    return NULL;
+	}
+	meta_kernel = kernel;
+    }
+
+    return Py_BuildValue("s", get_meta_kernel()->name);
 }
 
 static PyObject *
-ZshLines(UNUSED(PyObject *self), UNUSED(PyObject *args))
+ZshCodeCacheInfo(UNUSED(PyObject *self), UNUSED(PyObject *args))
 {
-    return PyLong_FromLong((long) zterm_lines);
+    return Py_BuildValue("{s:k,s:k,s:k,s:n,s:n}",
+	    "hits", codecache_hits,
+	    "misses", codecache_misses,
+	    "evictions", codecache_evictions,
+	    "size", (Py_ssize_t) codecache_size,
+	    "capacity", (Py_ssize_t) codecache_capacity);
 }
 
 static PyObject *
-ZshSubshell(UNUSED(PyObject *self), UNUSED(PyObject *args))
+ZshCodeCacheClear(UNUSED(PyObject *self), UNUSED(PyObject *args))
 {
-    return PyLong_FromLong((long) zsh_subshell);
+    codecache_clear();
+    Py_RETURN_NONE;
 }
 
 static PyObject *
-ZshPipeStatus(UNUSED(PyObject *self), UNUSED(PyObject *args))
+ZshCodeCacheSave(UNUSED(PyObject *self), PyObject *args)
 {
-    size_t i = 0;
-    PyObject *r = PyList_New(numpipestats);
-    PyObject *num;
+    char *path = codecache_file;
 
-    while (i < numpipestats) {
-	if (!(num = PyLong_FromLong(pipestats[i]))) {
-	    Py_DECREF(r);
-	    return NULL;
-	}
-	if (PyList_SetItem(r, i, num) == -1) {
-	    Py_DECREF(r);
-	    return NULL;
-	}
-	i++;
+    if (!PyArg_ParseTuple(args, "|s", &path))
+	return NULL;
+
+    if (!path) {
+	PyErr_SetString(PyExc_ValueError,
+		"No path given and $ZPYTHON_CODE_CACHE_FILE was not set "
+		"when module was loaded");
+	return NULL;
     }
-    return r;
+
+    if (codecache_save(path))
+	return NULL;
+
+    Py_RETURN_NONE;
 }
 
-static void
-free_sp(struct specialparam *sp)
+/* Builtins defined by zsh.define_builtin. Nodes are added to builtintab 
+ * directly and marked BINF_ADDED like builtins of loaded modules, they are 
+ * removed and freed by the module itself. */
+struct python_builtin {
+    struct builtin bn;
+    PyObject *func;
+    struct python_builtin *next;
+};
+
+static struct python_builtin *python_builtins = NULL;
+
+static struct python_builtin *
+find_python_builtin(const char *name)
 {
-    if (sp->prev)
-	sp->prev->next = sp->next;
-    else
-	first_assigned_param = sp->next;
+    struct python_builtin *pb;
 
-    if (sp->next)
-	sp->next->prev = sp->prev;
+    for (pb = python_builtins; pb; pb = pb->next)
+	if (!strcmp(pb->bn.node.nam, name))
+	    return pb;
+    return NULL;
+}
+
+/* Converts value returned by callable run from zsh to exit status: None and 
+ * True are 0, False is 1 and integer is used as is. Returns -1 with exception 
+ * set for other values. */
+static int
+get_exit_status(PyObject *ret)
+{
+    long status;
+
+    if (ret == Py_None)
+	return 0;
+    if (PyBool_Check(ret))
+	return ret == Py_False;
+    if (!PyNumber_Check(ret) || IS_PY_STRING(ret)) {
+	PyErr_SetString(PyExc_TypeError,
+		"Exit status must be None, bool or int");
+	return -1;
+    }
+    if ((status = PyLong_AsLong(ret)) == -1 && PyErr_Occurred())
+	return -1;
+    return (int) (status & 0xff);
+}
+
+/* Maps value returned by builtin callable to exit status like 
+ * get_exit_status, string is assigned to $REPLY with status 0 and (status, 
+ * reply) tuple sets both */
+static int
+python_builtin_status(PyObject *ret)
+{
+    PyObject *reply = NULL;
+    int status;
+
+    if (PyTuple_Check(ret) && PyTuple_GET_SIZE(ret) == 2) {
+	reply = PyTuple_GET_ITEM(ret, 1);
+	ret = PyTuple_GET_ITEM(ret, 0);
+    }
+    else if (IS_PY_STRING(ret)) {
+	reply = ret;
+	ret = Py_None;
+    }
+
+    if ((status = get_exit_status(ret)) == -1)
+	return -1;
+
+    if (reply && reply != Py_None
+	    && set_param_value(dupstring("REPLY"), reply) == -1)
+	return -1;
+
+    return status;
+}
+
+static int
+do_python_builtin(char *name, char **argv, UNUSED(Options ops), UNUSED(int func))
+{
+    struct python_builtin *pb;
+    PyObject *callable, *args, *ret;
+    int exit_code = 1;
+
+    PYTHON_INIT(1);
+
+    if (!(pb = find_python_builtin(name))) {
+	zwarnnam(name, "builtin is not defined by zpython");
+	PYTHON_FINISH;
+	return 1;
+    }
+
+    /* Callable may undefine or redefine the builtin, which frees pb */
+    callable = pb->func;
+    Py_INCREF(callable);
+    if ((args = get_array(argv))) {
+	ret = PyObject_CallFunctionObjArgs(callable, args, NULL);
+	Py_DECREF(args);
+	if (ret) {
+	    exit_code = python_builtin_status(ret);
+	    Py_DECREF(ret);
+	}
+    }
     else
-	last_assigned_param = sp->prev;
+	ret = NULL;
+    Py_DECREF(callable);
 
-    zsfree(sp->name);
-    PyMem_Free(sp);
+    if (!ret || exit_code == -1) {
+	PyErr_PrintEx(0);
+	exit_code = 1;
+    }
+    PyErr_Clear();
+
+    PYTHON_FINISH;
+    return exit_code;
 }
 
 static void
-unset_special_parameter(struct special_data *data)
+free_python_builtin(struct python_builtin *pb)
 {
-    Py_DECREF(data->obj);
-    free_sp(data->sp);
-    PyMem_Free(data);
+    if (builtintab->getnode2(builtintab, pb->bn.node.nam) == &pb->bn.node)
+	builtintab->removenode(builtintab, pb->bn.node.nam);
+    Py_DECREF(pb->func);
+    zsfree(pb->bn.node.nam);
+    zfree(pb, sizeof(struct python_builtin));
 }
 
+static PyObject *
+ZshDefineBuiltin(UNUSED(PyObject *self), PyObject *args)
+{
+    struct python_builtin *pb;
+    char *name;
+    PyObject *func;
+
+    if (check_main_thread())
+	return NULL;
 
-#define ZFAIL(errargs, failval) \
-    PyErr_PrintEx(0); \
-    PYTHON_FINISH; \
-    zerr errargs; \
-    return failval
+    if (!PyArg_ParseTuple(args, "sO", &name, &func))
+	return NULL;
 
-#define ZFAIL_NOFINISH(errargs, failval) \
-    PyErr_PrintEx(0); \
-    flush_io(); \
-    zerr errargs; \
-    return failval
+    if (!PyCallable_Check(func)) {
+	PyErr_SetString(PyExc_TypeError, "Builtin must be callable");
+	return NULL;
+    }
 
-struct sh_keyobj_data {
-    PyObject *obj;
-    PyObject *keyobj;
+    if ((pb = find_python_builtin(name))) {
+	Py_INCREF(func);
+	Py_DECREF(pb->func);
+	pb->func = func;
+	Py_RETURN_NONE;
+    }
+
+    if (builtintab->getnode2(builtintab, name)) {
+	PyErr_SetString(PyExc_ValueError, "Builtin with this name already exists");
+	return NULL;
+    }
+
+    pb = (struct python_builtin *) zshcalloc(sizeof(struct python_builtin));
+    pb->bn.node.nam = ztrdup(name);
+    pb->bn.node.flags = BINF_ADDED;
+    pb->bn.handlerfunc = do_python_builtin;
+    pb->bn.maxargs = -1;
+    builtintab->addnode(builtintab, pb->bn.node.nam, pb);
+
+    Py_INCREF(func);
+    pb->func = func;
+    pb->next = python_builtins;
+    python_builtins = pb;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ZshUndefineBuiltin(UNUSED(PyObject *self), PyObject *args)
+{
+    struct python_builtin **pbp, *pb;
+    char *name;
+
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+	return NULL;
+
+    for (pbp = &python_builtins; *pbp; pbp = &(*pbp)->next)
+	if (!strcmp((*pbp)->bn.node.nam, name))
+	    break;
+
+    if (!(pb = *pbp)) {
+	PyErr_SetString(PyExc_KeyError, "Builtin was not defined by zsh.define_builtin");
+	return NULL;
+    }
+
+    *pbp = pb->next;
+    free_python_builtin(pb);
+
+    Py_RETURN_NONE;
+}
+
+/* Hooks added by zsh.add_hook. Hooks of each kind are run by the shim function 
+ * which is appended to ${kind}_functions when the first hook of this kind is 
+ * added: they run after function named after the hook kind and after 
+ * functions which were in the array at that time, in order they were added. 
+ * Shim runs zpython -H which converts hook arguments once and calls hooks 
+ * directly. Removed hooks are only unlinked when no hooks are running. */
+#define HOOK_SHIM_PREFIX ZPYTHON_COMMAND_NAME "_hook_"
+
+struct python_hook {
+    PyObject *func;
+    long calls;
+    double total;
+    struct python_hook *next;
 };
 
-struct sh_key_data {
-    PyObject *obj;
-    char *key;
+static struct hook_kind {
+    const char *name;
+    struct python_hook *hooks;
+    int shim_installed;
+} hook_kinds[] = {
+    {"chpwd", NULL, 0},
+    {"periodic", NULL, 0},
+    {"precmd", NULL, 0},
+    {"preexec", NULL, 0},
+    {"zshaddhistory", NULL, 0},
+    {"zshexit", NULL, 0},
+    {NULL, NULL, 0},
 };
 
-static char *
-get_sh_item_value(PyObject *obj, PyObject *keyobj)
+static int hooks_running = 0;
+
+static struct hook_kind *
+find_hook_kind(const char *name)
 {
-    PyObject *valobj, *string;
-    char *str;
+    struct hook_kind *hk;
 
-    if (!(valobj = PyObject_GetItem(obj, keyobj))) {
-	if (PyErr_Occurred()) {
-	    /* Expected result: key not found */
-	    if (PyErr_ExceptionMatches(PyExc_KeyError)) {
-		PyErr_Clear();
-		return dupstring("");
-	    }
-	    /* Unexpected result: unknown exception */
-	    else
-		ZFAIL_NOFINISH(("Failed to get value object"), dupstring(""));
-	}
-	else
-	    return dupstring("");
-    }
+    for (hk = hook_kinds; hk->name; hk++)
+	if (!strcmp(hk->name, name))
+	    return hk;
+    return NULL;
+}
 
-    if (IS_PY_STRING(valobj))
-	string = valobj;
-    else {
-	if (!(string = PyObject_Str(valobj))) {
-	    ZFAIL_NOFINISH(("Failed to get value string object"), dupstring(""));
-	}
-	Py_DECREF(valobj);
-    }
+#define HOOK_SHIM_INSTALL \
+    HOOK_SHIM_PREFIX "%s() { " ZPYTHON_COMMAND_NAME " -H %s \"$@\" }; " \
+    "(( ${%s_functions[(I)" HOOK_SHIM_PREFIX "%s]} )) || " \
+    "%s_functions+=(" HOOK_SHIM_PREFIX "%s)"
+#define HOOK_SHIM_REMOVE \
+    "%s_functions=(${%s_functions:#" HOOK_SHIM_PREFIX "%s}); " \
+    "unfunction " HOOK_SHIM_PREFIX "%s 2>/dev/null"
 
-    if (!(str = get_chars(string, zhalloc))) {
-	Py_DECREF(string);
-	ZFAIL_NOFINISH(("Failed to get string from value string object"),
-		dupstring(""));
-    }
-    Py_DECREF(string);
-    return str;
+static void
+install_hook_shim(struct hook_kind *hk)
+{
+    char *buf;
+
+    if (hk->shim_installed)
+	return;
+
+    buf = zhalloc(sizeof(HOOK_SHIM_INSTALL) + 6 * strlen(hk->name));
+    sprintf(buf, HOOK_SHIM_INSTALL,
+	    hk->name, hk->name, hk->name, hk->name, hk->name, hk->name);
+    execstring(buf, 1, 0, ZPYTHON_COMMAND_NAME);
+    hk->shim_installed = 1;
+}
+
+static void
+remove_hook_shim(struct hook_kind *hk)
+{
+    char *buf;
+
+    if (!hk->shim_installed)
+	return;
+
+    buf = zhalloc(sizeof(HOOK_SHIM_REMOVE) + 4 * strlen(hk->name));
+    sprintf(buf, HOOK_SHIM_REMOVE, hk->name, hk->name, hk->name, hk->name);
+    execstring(buf, 1, 0, ZPYTHON_COMMAND_NAME);
+    hk->shim_installed = 0;
 }
 
-static char *
-get_sh_keyobj_value(Param pm)
+/* Frees removed hooks, or all hooks if all is set */
+static void
+prune_hooks(struct hook_kind *hk, int all)
 {
-    struct sh_keyobj_data *sh_kodata = (struct sh_keyobj_data *) pm->u.data;
-    return get_sh_item_value(sh_kodata->obj, sh_kodata->keyobj);
+    struct python_hook **php = &hk->hooks, *ph;
+
+    while ((ph = *php)) {
+	if (all || !ph->func) {
+	    *php = ph->next;
+	    Py_XDECREF(ph->func);
+	    PyMem_Free(ph);
+	}
+	else
+	    php = &ph->next;
+    }
 }
 
-static char *
-get_sh_key_value(Param pm)
+static int
+run_python_hooks(char *nam, char **args)
 {
-    char *r, *key;
-    PyObject *keyobj, *obj;
-    struct sh_key_data *sh_kdata = (struct sh_key_data *) pm->u.data;
+    struct hook_kind *hk;
+    struct python_hook *ph;
+    PyObject *list, *hargs;
+    int exit_code = 0;
 
-    PYTHON_INIT(dupstring(""));
+    if (!*args) {
+	zwarnnam(nam, "not enough arguments");
+	return 1;
+    }
+    if (!(hk = find_hook_kind(*args))) {
+	zwarnnam(nam, "unknown hook kind: %s", *args);
+	return 1;
+    }
+    if (!hk->hooks)
+	return 0;
 
-    obj = sh_kdata->obj;
-    key = sh_kdata->key;
+    PYTHON_INIT(1);
 
-    if (!(keyobj = get_string(key))) {
-	ZFAIL(("Failed to create key string object for key \"%s\"", key),
-		dupstring(""));
+    if (!(list = get_array(args + 1))) {
+	PyErr_PrintEx(0);
+	PYTHON_FINISH;
+	return 1;
     }
-    r = get_sh_item_value(obj, keyobj);
-    Py_DECREF(keyobj);
+    hargs = PyList_AsTuple(list);
+    Py_DECREF(list);
+    if (!hargs) {
+	PyErr_PrintEx(0);
+	PYTHON_FINISH;
+	return 1;
+    }
+
+    hooks_running++;
+    for (ph = hk->hooks; ph; ph = ph->next) {
+	PyObject *ret;
+	double start;
+	int status;
+
+	if (!ph->func)
+	    continue;
+
+	start = get_time();
+	ret = PyObject_Call(ph->func, hargs, NULL);
+	ph->total += get_time() - start;
+	ph->calls++;
+
+	if (!ret) {
+	    PyErr_PrintEx(0);
+	    exit_code = 1;
+	    continue;
+	}
+	if ((status = get_exit_status(ret)) == -1) {
+	    PyErr_PrintEx(0);
+	    status = 1;
+	}
+	Py_DECREF(ret);
+	if (status)
+	    exit_code = status;
+    }
+    hooks_running--;
+    Py_DECREF(hargs);
+
+    if (!hooks_running)
+	prune_hooks(hk, 0);
 
     PYTHON_FINISH;
-    return r;
+    return exit_code;
 }
 
-static void
-set_sh_item_value(PyObject *obj, PyObject *keyobj, char *val)
+static PyObject *
+ZshAddHook(UNUSED(PyObject *self), PyObject *args)
 {
-    PyObject *valobj;
+    struct hook_kind *hk;
+    struct python_hook *ph, **php;
+    char *kind;
+    PyObject *func;
 
-    if (!(valobj = get_string(val))) {
-	ZFAIL_NOFINISH(("Failed to create value string object"), );
+    if (check_main_thread())
+	return NULL;
+
+    if (!PyArg_ParseTuple(args, "sO", &kind, &func))
+	return NULL;
+
+    if (!(hk = find_hook_kind(kind))) {
+	PyErr_SetString(PyExc_ValueError, "Unknown hook kind");
+	return NULL;
     }
 
-    if (PyObject_SetItem(obj, keyobj, valobj) == -1) {
-	Py_DECREF(valobj);
-	ZFAIL_NOFINISH(("Failed to set object to \"%s\"", val), );
+    if (!PyCallable_Check(func)) {
+	PyErr_SetString(PyExc_TypeError, "Hook must be callable");
+	return NULL;
     }
-    Py_DECREF(valobj);
+
+    for (php = &hk->hooks; (ph = *php); php = &ph->next) {
+	int r;
+
+	if (!ph->func)
+	    continue;
+	if ((r = PyObject_RichCompareBool(ph->func, func, Py_EQ)) == -1)
+	    return NULL;
+	if (r)
+	    Py_RETURN_NONE;
+    }
+
+    if (!(ph = PyMem_New(struct python_hook, 1)))
+	return PyErr_NoMemory();
+
+    Py_INCREF(func);
+    ph->func = func;
+    ph->calls = 0;
+    ph->total = 0.0;
+    ph->next = NULL;
+    *php = ph;
+
+    install_hook_shim(hk);
+
+    Py_RETURN_NONE;
 }
 
-static void
-set_sh_key_value(Param pm, char *val)
+static PyObject *
+ZshRemoveHook(UNUSED(PyObject *self), PyObject *args)
 {
-    PyObject *obj, *keyobj;
-    char *key;
-    struct sh_key_data *sh_kdata = (struct sh_key_data *) pm->u.data;
+    struct hook_kind *hk;
+    struct python_hook *ph;
+    char *kind;
+    PyObject *func;
+    int found = 0, left = 0;
 
-    PYTHON_INIT();
+    if (check_main_thread())
+	return NULL;
 
-    obj = sh_kdata->obj;
-    key = sh_kdata->key;
+    if (!PyArg_ParseTuple(args, "sO", &kind, &func))
+	return NULL;
 
-    if (!(keyobj = get_string(key))) {
-	ZFAIL(("Failed to create key string object for key \"%s\"", key), );
+    if (!(hk = find_hook_kind(kind))) {
+	PyErr_SetString(PyExc_ValueError, "Unknown hook kind");
+	return NULL;
     }
-    set_sh_item_value(obj, keyobj, val);
-    Py_DECREF(keyobj);
 
-    PYTHON_FINISH;
+    for (ph = hk->hooks; ph; ph = ph->next) {
+	int r;
+
+	if (!ph->func)
+	    continue;
+	if (found) {
+	    left = 1;
+	    break;
+	}
+	if ((r = PyObject_RichCompareBool(ph->func, func, Py_EQ)) == -1)
+	    return NULL;
+	if (r) {
+	    Py_CLEAR(ph->func);
+	    found = 1;
+	}
+	else
+	    left = 1;
+    }
+
+    if (!found) {
+	PyErr_SetString(PyExc_ValueError, "Hook was not added");
+	return NULL;
+    }
+
+    if (!hooks_running)
+	prune_hooks(hk, 0);
+    if (!left)
+	remove_hook_shim(hk);
+
+    Py_RETURN_NONE;
 }
 
-static void
-set_sh_keyobj_value(Param pm, char *val)
+static PyObject *
+get_hook_timings(void)
 {
-    struct sh_keyobj_data *sh_kodata = (struct sh_keyobj_data *) pm->u.data;
-    set_sh_item_value(sh_kodata->obj, sh_kodata->keyobj, val);
+    struct hook_kind *hk;
+    struct python_hook *ph;
+    PyObject *r, *list, *item;
+
+    if (!(r = PyDict_New()))
+	return NULL;
+
+    for (hk = hook_kinds; hk->name; hk++) {
+	if (!hk->hooks)
+	    continue;
+	if (!(list = PyList_New(0))) {
+	    Py_DECREF(r);
+	    return NULL;
+	}
+	for (ph = hk->hooks; ph; ph = ph->next) {
+	    if (!ph->func)
+		continue;
+	    if (!(item = Py_BuildValue("(Old)", ph->func, ph->calls, ph->total))
+		    || PyList_Append(list, item) == -1) {
+		Py_XDECREF(item);
+		Py_DECREF(list);
+		Py_DECREF(r);
+		return NULL;
+	    }
+	    Py_DECREF(item);
+	}
+	if (PyDict_SetItemString(r, hk->name, list) == -1) {
+	    Py_DECREF(list);
+	    Py_DECREF(r);
+	    return NULL;
+	}
+	Py_DECREF(list);
+    }
+
+    return r;
 }
 
-static struct gsu_scalar sh_keyobj_gsu =
-{get_sh_keyobj_value, set_sh_keyobj_value, nullunsetfn};
-static struct gsu_scalar sh_key_gsu =
-{get_sh_key_value, set_sh_key_value, nullunsetfn};
+/* ZLE widgets defined by zsh.zle.define_widget. Each widget is bound to the 
+ * shim function running zpython -w which calls widget callable with the 
+ * context object. Context attributes read and write zle state through 
+ * accessors of zle special parameters, converting only accessed values; 
+ * context is only valid while widget runs. */
+#define WIDGET_SHIM_PREFIX ZPYTHON_COMMAND_NAME "_widget_"
 
-static HashNode
-get_sh_item(HashTable ht, const char *key)
+static PyObject *zle_widgets = NULL;
+
+typedef struct {
+    PyObject_HEAD
+    int active;
+} WidgetObject;
+
+static PyTypeObject WidgetType;
+
+static Param
+get_zle_param(const char *name)
 {
-    PyObject *obj = ((struct obj_hash_node *) (*ht->nodes))->obj;
     Param pm;
-    struct sh_key_data *sh_kdata;
 
-    PYTHON_INIT(NULL);
+    if (!(pm = (Param) paramtab->getnode(paramtab, name))
+	    || (pm->node.flags & PM_UNSET)) {
+	PyErr_Format(PyExc_RuntimeError, "Zle parameter %s is not available",
+		name);
+	return NULL;
+    }
+    return pm;
+}
 
-    pm = (Param) hcalloc(sizeof(struct param));
-    pm->node.nam = dupstring(key);
-    pm->node.flags = PM_SCALAR;
-    pm->gsu.s = &sh_key_gsu;
+static Param
+get_widget_param(PyObject *self, const char *name)
+{
+    if (check_main_thread())
+	return NULL;
 
-    sh_kdata = (struct sh_key_data *) hcalloc(sizeof(struct sh_key_data) * 1);
-    sh_kdata->obj = obj;
-    sh_kdata->key = dupstring(key);
+    if (!((WidgetObject *) self)->active) {
+	PyErr_SetString(PyExc_RuntimeError,
+		"Widget context is only valid while widget runs");
+	return NULL;
+    }
+    return get_zle_param(name);
+}
 
-    pm->u.data = (void *) sh_kdata;
+static PyObject *
+WidgetGet(PyObject *self, void *closure)
+{
+    Param pm;
 
-    PYTHON_FINISH;
+    if (!(pm = get_widget_param(self, (const char *) closure)))
+	return NULL;
 
-    return &pm->node;
+    switch (PM_TYPE(pm->node.flags)) {
+    case PM_INTEGER:
+	return PyLong_FromLongLong((long long) pm->gsu.i->getfn(pm));
+    case PM_ARRAY:
+	return get_array(pm->gsu.a->getfn(pm));
+    default:
+	return get_string(pm->gsu.s->getfn(pm));
+    }
 }
 
-static void
-scan_special_hash(HashTable ht, ScanFunc func, int flags)
+static int
+WidgetSet(PyObject *self, PyObject *value, void *closure)
 {
-    PyObject *obj = ((struct obj_hash_node *) (*ht->nodes))->obj;
-    PyObject *iter, *keyobj;
-    struct param pm;
-
-    memset((void *) &pm, 0, sizeof(struct param));
-    pm.node.flags = PM_SCALAR;
-    pm.gsu.s = &sh_keyobj_gsu;
+    Param pm;
 
-    PYTHON_INIT();
+    if (!(pm = get_widget_param(self, (const char *) closure)))
+	return -1;
 
-    if (!(iter = PyObject_GetIter(obj))) {
-	ZFAIL(("Failed to get iterator"), );
+    if (!value) {
+	PyErr_SetString(PyExc_AttributeError, "Cannot delete zle parameter");
+	return -1;
+    }
+    if (pm->node.flags & PM_READONLY) {
+	PyErr_Format(PyExc_AttributeError, "Zle parameter %s is read-only",
+		(const char *) closure);
+	return -1;
     }
 
-    while ((keyobj = PyIter_Next(iter))) {
-	char *str;
-	struct sh_keyobj_data sh_kodata;
-
-	if (!IS_PY_STRING(keyobj)) {
-	    Py_DECREF(iter);
-	    Py_DECREF(keyobj);
-	    ZFAIL(("Key is not a string"), );
+    switch (PM_TYPE(pm->node.flags)) {
+    case PM_INTEGER:
+	{
+	    PyObject *obj;
+	    zlong i;
+
+	    if (!(obj = PyNumber_Long(value)))
+		return -1;
+	    i = (zlong) PyLong_AsLongLong(obj);
+	    Py_DECREF(obj);
+	    if (i == -1 && PyErr_Occurred())
+		return -1;
+	    pm->gsu.i->setfn(pm, i);
+	    break;
 	}
+    case PM_ARRAY:
+	{
+	    char **val;
 
-	if (!(str = get_chars(keyobj, zhalloc))) {
-	    Py_DECREF(iter);
-	    Py_DECREF(keyobj);
-	    ZFAIL(("Failed to get string from key string object"), );
+	    if (!(val = get_chars_array(value, zalloc, zfree)))
+		return -1;
+	    pm->gsu.a->setfn(pm, val);
+	    break;
 	}
-	pm.node.nam = str;
-
-	sh_kodata.obj = obj;
-	sh_kodata.keyobj = keyobj;
-	pm.u.data = (void *) &sh_kodata;
-
-	func(&pm.node, flags);
+    default:
+	{
+	    char *val;
 
-	Py_DECREF(keyobj);
+	    if (!IS_PY_STRING(value)) {
+		PyErr_SetString(PyExc_TypeError, "Value must be a string");
+		return -1;
+	    }
+	    if (!(val = get_chars(value, zalloc)))
+		return -1;
+	    pm->gsu.s->setfn(pm, val);
+	    break;
+	}
     }
-    Py_DECREF(iter);
 
-    PYTHON_FINISH;
+    return 0;
 }
 
-static char *
-get_special_string(Param pm)
+static PyGetSetDef WidgetGetSet[] = {
+    {"buffer", WidgetGet, WidgetSet, "Edit buffer ($BUFFER)", "BUFFER"},
+    {"lbuffer", WidgetGet, WidgetSet, "Part of buffer left of cursor ($LBUFFER)",
+	"LBUFFER"},
+    {"rbuffer", WidgetGet, WidgetSet, "Part of buffer right of cursor ($RBUFFER)",
+	"RBUFFER"},
+    {"cursor", WidgetGet, WidgetSet, "Cursor position ($CURSOR)", "CURSOR"},
+    {"mark", WidgetGet, WidgetSet, "Mark position ($MARK)", "MARK"},
+    {"killring", WidgetGet, WidgetSet, "Kill ring ($killring)", "killring"},
+    {"cutbuffer", WidgetGet, WidgetSet, "Last killed text ($CUTBUFFER)",
+	"CUTBUFFER"},
+    {"widget", WidgetGet, NULL, "Name of the widget ($WIDGET)", "WIDGET"},
+    {"keys", WidgetGet, NULL, "Keys typed to invoke widget ($KEYS)", "KEYS"},
+    {"numeric", WidgetGet, NULL, "Numeric argument ($NUMERIC)", "NUMERIC"},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static int
+run_python_widget(char *nam, char **args)
 {
-    PyObject *robj;
-    char *r;
+    PyObject *func, *ret;
+    WidgetObject *widget;
+    int exit_code = 1;
 
-    PYTHON_INIT(dupstring(""));
+    if (!*args || args[1]) {
+	zwarnnam(nam, *args ? "too many arguments" : "not enough arguments");
+	return 1;
+    }
 
-    if (!(robj = PyObject_Str(((struct special_data *) pm->u.data)->obj))) {
-	ZFAIL(("Failed to create string object for parameter %s",
-		    pm->node.nam), dupstring(""));
+    PYTHON_INIT(1);
+
+    if (!zle_widgets || !(func = PyDict_GetItemString(zle_widgets, *args))) {
+	zwarnnam(nam, "widget is not defined by zpython: %s", *args);
+	PYTHON_FINISH;
+	return 1;
     }
 
-    if (!(r = get_chars(robj, zhalloc))) {
-	ZFAIL(("Failed to transform value for parameter %s", pm->node.nam),
-		dupstring(""));
+    if ((widget = PyObject_NEW(WidgetObject, &WidgetType))) {
+	widget->active = 1;
+	Py_INCREF(func);
+	ret = PyObject_CallFunctionObjArgs(func, (PyObject *) widget, NULL);
+	Py_DECREF(func);
+	widget->active = 0;
+	Py_DECREF(widget);
+	if (ret) {
+	    exit_code = get_exit_status(ret);
+	    Py_DECREF(ret);
+	}
     }
+    else
+	ret = NULL;
 
-    Py_DECREF(robj);
+    if (!ret || exit_code == -1) {
+	PyErr_PrintEx(0);
+	exit_code = 1;
+    }
+    PyErr_Clear();
 
     PYTHON_FINISH;
-
-    return r;
+    return exit_code;
 }
 
-static zlong
-get_special_integer(Param pm)
+/* Widget names are pasted into shim definitions: allow only characters which 
+ * need no quoting */
+static int
+valid_widget_name(const char *name)
 {
-    PyObject *robj;
-    zlong r;
-
-    PYTHON_INIT(0);
-
-    if (!(robj = PyNumber_Long(((struct special_data *) pm->u.data)->obj))) {
-	ZFAIL(("Failed to create int object for parameter %s", pm->node.nam),
-		0);
-    }
-
-    r = PyLong_AsLong(robj);
+    const char *p;
 
-    Py_DECREF(robj);
+    if (!*name)
+	return 0;
+    for (p = name; *p; p++)
+	if (!(*p >= 'a' && *p <= 'z') && !(*p >= 'A' && *p <= 'Z')
+		&& !(*p >= '0' && *p <= '9') && !strchr("_-.:+", *p))
+	    return 0;
+    return 1;
+}
 
-    PYTHON_FINISH;
+static void
+remove_widget_shim(const char *name)
+{
+    char *s;
 
-    return r;
+    s = zhtricat("zle -D ", name, " 2>/dev/null; unfunction ");
+    s = zhtricat(s, WIDGET_SHIM_PREFIX, name);
+    execstring(dyncat(s, " 2>/dev/null"), 1, 0, ZPYTHON_COMMAND_NAME);
 }
 
-static double
-get_special_float(Param pm)
+static PyObject *
+ZleDefineWidget(UNUSED(PyObject *self), PyObject *args)
 {
-    PyObject *robj;
-    float r;
+    char *name, *s;
+    PyObject *func;
 
-    PYTHON_INIT(0.0);
+    if (check_main_thread())
+	return NULL;
 
-    if (!(robj = PyNumber_Float(((struct special_data *) pm->u.data)->obj))) {
-	ZFAIL(("Failed to create float object for parameter %s", pm->node.nam),
-		0);
+    if (!PyArg_ParseTuple(args, "sO", &name, &func))
+	return NULL;
+
+    if (!valid_widget_name(name)) {
+	PyErr_SetString(PyExc_ValueError, "Invalid widget name");
+	return NULL;
+    }
+    if (!PyCallable_Check(func)) {
+	PyErr_SetString(PyExc_TypeError, "Widget must be callable");
+	return NULL;
     }
 
-    r = PyFloat_AsDouble(robj);
+    if (!zle_widgets && !(zle_widgets = PyDict_New()))
+	return NULL;
 
-    Py_DECREF(robj);
+    if (!PyDict_GetItemString(zle_widgets, name)) {
+	s = zhtricat(WIDGET_SHIM_PREFIX, name, "() { " ZPYTHON_COMMAND_NAME " -w ");
+	s = zhtricat(s, name, " }; zle -N ");
+	s = zhtricat(s, name, " " WIDGET_SHIM_PREFIX);
+	execstring(dyncat(s, name), 1, 0, ZPYTHON_COMMAND_NAME);
+	if (lastval) {
+	    remove_widget_shim(name);
+	    PyErr_SetString(PyExc_RuntimeError, "Failed to define widget");
+	    return NULL;
+	}
+    }
 
-    PYTHON_FINISH;
+    if (PyDict_SetItemString(zle_widgets, name, func) == -1)
+	return NULL;
 
-    return r;
+    Py_RETURN_NONE;
 }
 
-static char **
-get_special_array(Param pm)
+static PyObject *
+ZleUndefineWidget(UNUSED(PyObject *self), PyObject *args)
 {
-    char **r;
+    char *name;
 
-    PYTHON_INIT(hcalloc(sizeof(char **)));
+    if (check_main_thread())
+	return NULL;
 
-    if (!(r = get_chars_array(((struct special_data *) pm->u.data)->obj,
-		    zhalloc, NULL))) {
-	ZFAIL(("Failed to create array object for parameter %s", pm->node.nam),
-		hcalloc(sizeof(char **)));
+    if (!PyArg_ParseTuple(args, "s", &name))
+	return NULL;
+
+    if (!zle_widgets || !PyDict_GetItemString(zle_widgets, name)) {
+	PyErr_SetString(PyExc_KeyError,
+		"Widget was not defined by zsh.zle.define_widget");
+	return NULL;
     }
 
-    PYTHON_FINISH;
+    if (PyDict_DelItemString(zle_widgets, name) == -1)
+	return NULL;
+    remove_widget_shim(name);
 
-    return r;
+    Py_RETURN_NONE;
 }
 
 static void
-set_special_string(Param pm, char *val)
+remove_widgets(void)
 {
-    PyObject *r, *args;
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
 
-    PYTHON_INIT();
+    if (!zle_widgets)
+	return;
 
-    if (!val) {
-	unset_special_parameter((struct special_data *) pm->u.data);
+    while (PyDict_Next(zle_widgets, &pos, &key, &value)) {
+	char *name;
 
-	PYTHON_FINISH;
-	return;
+	if ((name = get_chars(key, zhalloc)))
+	    remove_widget_shim(name);
+	else
+	    PyErr_Clear();
     }
+    Py_CLEAR(zle_widgets);
+}
 
-    args = Py_BuildValue("(O&)", get_string, val);
-    r = PyObject_CallObject(((struct special_data *) pm->u.data)->obj, args);
-    Py_DECREF(args);
-    if (!r) {
-	PyErr_PrintEx(0);
-	zerr("Failed to assign value for string parameter %s", pm->node.nam);
-	PYTHON_FINISH;
-	return;
-    }
-    Py_DECREF(r);
+/* Bulk region_highlight updates. Regions are (start, end, style id) triples, 
+ * style ids index the list set by set_highlight_styles. Entries formatted for 
+ * the previous call are kept, so only regions that changed are formatted again 
+ * and region_highlight is not assigned at all if nothing changed. Cache is 
+ * dropped when $HISTCMD changes as zle starts new line with empty 
+ * region_highlight. */
+static char **hl_styles = NULL;
+static zlong hl_histcmd = -1;
+static int *hl_regions = NULL;
+static char **hl_entries = NULL;
+static int hl_count = 0;
 
-    PYTHON_FINISH;
+static void
+clear_highlight_cache(void)
+{
+    if (hl_entries) {
+	freearray(hl_entries);
+	hl_entries = NULL;
+    }
+    if (hl_regions) {
+	PyMem_Free(hl_regions);
+	hl_regions = NULL;
+    }
+    hl_count = 0;
 }
 
-static void
-set_special_integer(Param pm, zlong val)
+/* Returns array of 3 * *countp ints in PyMem memory */
+static int *
+get_highlight_regions(PyObject *regions, int *countp)
 {
-    PyObject *r, *args;
+    int *r;
+    Py_ssize_t n, i;
+    PyObject *seq;
 
-    PYTHON_INIT();
+    if (!IS_PY_STRING(regions) && PyObject_CheckBuffer(regions)) {
+	Py_buffer view;
 
-    args = Py_BuildValue("(L)", (long long) val);
-    r = PyObject_CallObject(((struct special_data *) pm->u.data)->obj, args);
-    Py_DECREF(args);
-    if (!r) {
-	PyErr_PrintEx(0);
-	zerr("Failed to assign value for integer parameter %s", pm->node.nam);
-	PYTHON_FINISH;
-	return;
+	if (PyObject_GetBuffer(regions, &view, PyBUF_SIMPLE) == -1)
+	    return NULL;
+	if (view.len % (3 * sizeof(int))) {
+	    PyBuffer_Release(&view);
+	    PyErr_SetString(PyExc_ValueError,
+		    "Buffer size must be a multiple of three ints");
+	    return NULL;
+	}
+	n = view.len / sizeof(int);
+	if (!(r = PyMem_New(int, n + 1))) {
+	    PyBuffer_Release(&view);
+	    PyErr_NoMemory();
+	    return NULL;
+	}
+	memcpy(r, view.buf, view.len);
+	PyBuffer_Release(&view);
+	*countp = (int) (n / 3);
+	return r;
     }
-    Py_DECREF(r);
 
-    PYTHON_FINISH;
-}
+    if (!(seq = PySequence_Fast(regions,
+		    "Regions must be a sequence or a buffer of ints")))
+	return NULL;
 
-static void
-set_special_float(Param pm, double val)
-{
-    PyObject *r, *args;
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (!(r = PyMem_New(int, 3 * n + 1))) {
+	Py_DECREF(seq);
+	PyErr_NoMemory();
+	return NULL;
+    }
 
-    PYTHON_INIT();
+    for (i = 0; i < n; i++) {
+	PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+	Py_ssize_t j;
 
-    args = Py_BuildValue("(d)", val);
-    r = PyObject_CallObject(((struct special_data *) pm->u.data)->obj, args);
-    Py_DECREF(args);
-    if (!r) {
-	PyErr_PrintEx(0);
-	zerr("Failed to assign value for float parameter %s", pm->node.nam);
-	PYTHON_FINISH;
-	return;
+	if (!PyTuple_Check(item) && !PyList_Check(item)) {
+	    PyErr_SetString(PyExc_TypeError,
+		    "Region must be a (start, end, style) tuple");
+	    goto fail;
+	}
+	if (PySequence_Fast_GET_SIZE(item) != 3) {
+	    PyErr_SetString(PyExc_ValueError,
+		    "Region must be a (start, end, style) tuple");
+	    goto fail;
+	}
+	for (j = 0; j < 3; j++) {
+	    long v = PyLong_AsLong(PySequence_Fast_GET_ITEM(item, j));
+
+	    if (v == -1 && PyErr_Occurred())
+		goto fail;
+	    r[3 * i + j] = (int) v;
+	}
     }
-    Py_DECREF(r);
+    Py_DECREF(seq);
+    *countp = (int) n;
+    return r;
 
-    PYTHON_FINISH;
+fail:
+    Py_DECREF(seq);
+    PyMem_Free(r);
+    return NULL;
 }
 
-static void
-set_special_array(Param pm, char **val)
+static PyObject *
+ZleSetHighlightStyles(UNUSED(PyObject *self), PyObject *styles)
 {
-    PyObject *r, *args;
-
-    PYTHON_INIT();
+    char **val;
 
-    if (!val) {
-	unset_special_parameter((struct special_data *) pm->u.data);
+    if (check_main_thread())
+	return NULL;
 
-	PYTHON_FINISH;
-	return;
-    }
+    if (!(val = get_chars_array(styles, zalloc, zfree)))
+	return NULL;
 
-    args = Py_BuildValue("(O&)", get_array, val);
-    r = PyObject_CallObject(((struct special_data *) pm->u.data)->obj, args);
-    Py_DECREF(args);
-    if (!r) {
-	PyErr_PrintEx(0);
-	zerr("Failed to assign value for array parameter %s", pm->node.nam);
-	PYTHON_FINISH;
-	return;
-    }
-    Py_DECREF(r);
+    if (hl_styles)
+	freearray(hl_styles);
+    hl_styles = val;
+    clear_highlight_cache();
 
-    PYTHON_FINISH;
+    Py_RETURN_NONE;
 }
 
-static void
-set_special_hash(Param pm, HashTable ht)
+static PyObject *
+ZleHighlight(UNUSED(PyObject *self), PyObject *args, PyObject *kwargs)
 {
-    int i;
-    HashNode hn;
-    PyObject *obj = ((struct obj_hash_node *) (*pm->u.hash->nodes))->obj;
-    PyObject *keys, *iter, *keyobj;
+    static char *kwlist[] = {"regions", "force", NULL};
+    PyObject *regions, *force = NULL;
+    int *cur, count, nstyles, changed = 0, forced, i;
+    char **entries;
+    Param pm;
 
-    if (pm->u.hash == ht)
-	return;
+    if (check_main_thread())
+	return NULL;
 
-    PYTHON_INIT();
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist,
+		&regions, &force))
+	return NULL;
 
-    if (!ht) {
-	struct specialparam *sp =
-	    ((struct obj_hash_node *) (*pm->u.hash->nodes))->sp;
-	free_sp(sp);
-	Py_DECREF(obj);
-	PYTHON_FINISH;
-	return;
-    }
+    if (!(pm = get_zle_param("region_highlight")))
+	return NULL;
+    if (!(cur = get_highlight_regions(regions, &count)))
+	return NULL;
 
-    /* Can't use PyObject_GetIter on the object itself: it fails if object is 
-     * being modified */
-    if (!(keys = PyMapping_Keys(obj))) {
-	ZFAIL(("Failed to get object keys"), );
-    }
-    if (!(iter = PyObject_GetIter(keys))) {
-	ZFAIL(("Failed to get keys iterator"), );
-    }
-    while ((keyobj = PyIter_Next(iter))) {
-	if (PyMapping_DelItem(obj, keyobj) == -1) {
-	    ZFAIL(("Failed to delete some key"), );
+    nstyles = hl_styles ? arrlen(hl_styles) : 0;
+    for (i = 0; i < count; i++)
+	if (cur[3 * i + 2] < 0 || cur[3 * i + 2] >= nstyles) {
+	    PyMem_Free(cur);
+	    PyErr_SetString(PyExc_IndexError, "Style id out of range");
+	    return NULL;
+	}
+
+    forced = force && PyObject_IsTrue(force);
+    if (forced || hl_histcmd != getiparam("HISTCMD"))
+	clear_highlight_cache();
+    hl_histcmd = getiparam("HISTCMD");
+
+    entries = (char **) zalloc((count + 1) * sizeof(char *));
+    for (i = 0; i < count; i++) {
+	int *reg = cur + 3 * i;
+
+	if (i < hl_count && !memcmp(reg, hl_regions + 3 * i, 3 * sizeof(int))) {
+	    entries[i] = hl_entries[i];
+	    hl_entries[i] = NULL;
+	}
+	else {
+	    char buf[32];
+
+	    sprintf(buf, "%d %d ", reg[0], reg[1]);
+	    entries[i] = bicat(buf, hl_styles[reg[2]]);
+	    changed++;
 	}
-	Py_DECREF(keyobj);
     }
-    Py_DECREF(iter);
-    Py_DECREF(keys);
+    entries[count] = NULL;
+    changed += count < hl_count ? hl_count - count : 0;
+
+    /* Entries moved to the new array were replaced with NULL */
+    if (hl_entries) {
+	for (i = 0; i < hl_count; i++)
+	    zsfree(hl_entries[i]);
+	zfree(hl_entries, (hl_count + 1) * sizeof(char *));
+    }
+    if (hl_regions)
+	PyMem_Free(hl_regions);
+    hl_entries = entries;
+    hl_regions = cur;
+    hl_count = count;
 
-    for (i = 0; i < ht->hsize; i++)
-	for (hn = ht->nodes[i]; hn; hn = hn->next) {
-	    struct value v;
-	    char *val;
-	    PyObject *valobj, *keyobj;
+    if (changed || forced)
+	pm->gsu.a->setfn(pm, zarrdup(entries));
 
-	    v.isarr = v.flags = v.start = 0;
-	    v.end = -1;
-	    v.arr = NULL;
-	    v.pm = (Param) hn;
+    return PyLong_FromLong((long) changed);
+}
 
-	    val = getstrvalue(&v);
-	    if (!val) {
-		ZFAIL(("Failed to get string value"), );
-	    }
+static struct PyMethodDef ZleMethods[] = {
+    {"define_widget", ZleDefineWidget, METH_VARARGS,
+	"Define zle widget which calls given callable with the widget context.\n"
+	"Context attributes buffer, lbuffer, rbuffer, cursor, mark, killring and\n"
+	"cutbuffer read and set zle state, widget, keys and numeric are read-only.\n"
+	"Return value is used as widget status like for define_builtin"},
+    {"undefine_widget", ZleUndefineWidget, METH_VARARGS,
+	"Remove widget defined by define_widget.\n"
+	"Throws KeyError if widget was not defined by define_widget"},
+    {"set_highlight_styles", ZleSetHighlightStyles, METH_O,
+	"Set list of region_highlight styles referenced by highlight by index"},
+    {"highlight", (PyCFunction) ZleHighlight, METH_VARARGS|METH_KEYWORDS,
+	"highlight(regions, force=False)\n"
+	"Set region_highlight from a sequence of (start, end, style id) tuples or\n"
+	"a buffer of native ints, three per region. Only regions that differ\n"
+	"from the previous call are formatted and region_highlight is not\n"
+	"assigned if nothing changed, unless force is true.\n"
+	"Returns number of changed regions"},
+    {NULL, NULL, 0, NULL},
+};
 
-	    if (!(valobj = get_string(val))) {
-		ZFAIL(("Failed to convert value \"%s\" to string object "
-			    "while processing key", val, hn->nam), );
-	    }
-	    if (!(keyobj = get_string(hn->nam))) {
-		Py_DECREF(valobj);
-		ZFAIL(("Failed to convert key \"%s\" to string object",
-			    hn->nam), );
-	    }
+/* asyncio event loop driven by zle. Loop uses selector which has its own file 
+ * descriptor (epoll or kqueue): it is watched with zle -F, so widget running 
+ * zpython -e performs one loop iteration on the main thread whenever some 
+ * registered file descriptor is ready or loop self-pipe is written to. Timers 
+ * are served by a thread waking the loop up with call_soon_threadsafe, next 
+ * timer is taken from the loop scheduled heap after each iteration. zpython 
+ * calls also wake loop up to run callbacks they scheduled. */
+#define EVENT_LOOP_FUNC ZPYTHON_COMMAND_NAME "_event_loop"
+#define EVENT_LOOP_WIDGET ZPYTHON_COMMAND_NAME "-event-loop"
+#define EVENT_LOOP_START \
+    EVENT_LOOP_FUNC "() { " ZPYTHON_COMMAND_NAME " -e }; " \
+    "zle -N " EVENT_LOOP_WIDGET " " EVENT_LOOP_FUNC " && " \
+    "zle -F -w %ld " EVENT_LOOP_WIDGET
+#define EVENT_LOOP_STOP "zle -F %d 2>/dev/null; " \
+    "zle -D " EVENT_LOOP_WIDGET " 2>/dev/null; " \
+    "unfunction " EVENT_LOOP_FUNC " 2>/dev/null"
+
+#if PY_VERSION_HEX >= 0x03040000
+static PyObject *event_loop_timer_event = NULL;
+static double event_loop_deadline = -1;
+static PyObject *event_loop_wakeup = NULL;
+static PyObject *event_loop_noop_obj = NULL;
+static int event_loop_fd = -1;
 
-	    if (PyObject_SetItem(obj, keyobj, valobj) == -1) {
-		Py_DECREF(valobj);
-		Py_DECREF(keyobj);
-		ZFAIL(("Failed to set key %s", hn->nam), );
-	    }
+static PyObject *
+event_loop_noop(UNUSED(PyObject *self), UNUSED(PyObject *args))
+{
+    Py_RETURN_NONE;
+}
 
-	    Py_DECREF(valobj);
-	    Py_DECREF(keyobj);
+static PyMethodDef event_loop_noop_def =
+    {"event_loop_noop", event_loop_noop, METH_NOARGS, NULL};
+
+static void
+wake_event_loop(void)
+{
+    PyObject *r;
+
+    if (!(r = PyObject_CallFunctionObjArgs(event_loop_wakeup,
+		    event_loop_noop_obj, NULL)))
+	PyErr_PrintEx(0);
+    else
+	Py_DECREF(r);
+}
+
+/* Timers are waited for by one daemon thread: it sleeps on 
+ * event_loop_timer_event until event_loop_deadline (in loop.time() units, 
+ * negative if there is nothing to wait for) and wakes the loop up. Deadline 
+ * is changed with the GIL held, the event is set to make the thread pick new 
+ * deadline up. Thread exits once its event is no longer the current one. */
+static PyObject *
+event_loop_timer_run(UNUSED(PyObject *self), PyObject *event)
+{
+    PyObject *now, *r;
+    double timeout;
+
+    while (event == event_loop_timer_event) {
+	if (event_loop_deadline < 0)
+	    r = PyObject_CallMethod(event, "wait", NULL);
+	else {
+	    if (!(now = PyObject_CallMethod(event_loop, "time", NULL)))
+		return NULL;
+	    timeout = event_loop_deadline - PyFloat_AsDouble(now);
+	    Py_DECREF(now);
+	    if (event != event_loop_timer_event)
+		break;
+	    if (timeout <= 0) {
+		event_loop_deadline = -1;
+		wake_event_loop();
+		continue;
+	    }
+	    r = PyObject_CallMethod(event, "wait", "d", timeout);
 	}
-    PYTHON_FINISH;
+	if (!r)
+	    return NULL;
+	Py_DECREF(r);
+	if (!(r = PyObject_CallMethod(event, "clear", NULL)))
+	    return NULL;
+	Py_DECREF(r);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef event_loop_timer_run_def =
+    {"event_loop_timer", event_loop_timer_run, METH_O, NULL};
+
+static int
+start_event_loop_timer(void)
+{
+    PyObject *threading, *event, *target, *thread, *r;
+
+    if (!(threading = PyImport_ImportModule("threading")))
+	return 1;
+    if (!(event = PyObject_CallMethod(threading, "Event", NULL))) {
+	Py_DECREF(threading);
+	return 1;
+    }
+    if (!(target = PyCFunction_New(&event_loop_timer_run_def, NULL))) {
+	Py_DECREF(event);
+	Py_DECREF(threading);
+	return 1;
+    }
+    thread = PyObject_CallMethod(threading, "Thread", "OOO(O)",
+	    Py_None, target, Py_None, event);
+    Py_DECREF(target);
+    Py_DECREF(threading);
+    if (!thread) {
+	Py_DECREF(event);
+	return 1;
+    }
+    /* Thread checks event identity, so it must be current before start */
+    event_loop_timer_event = event;
+    if (PyObject_SetAttrString(thread, "daemon", Py_True) == -1
+	    || !(r = PyObject_CallMethod(thread, "start", NULL))) {
+	Py_CLEAR(event_loop_timer_event);
+	Py_DECREF(thread);
+	return 1;
+    }
+    Py_DECREF(r);
+    Py_DECREF(thread);
+    return 0;
 }
 
 static void
-unsetfn(Param pm, int exp)
+set_event_loop_deadline(double deadline)
 {
-    unset_special_parameter((struct special_data *) pm->u.data);
-    stdunsetfn(pm, exp);
+    PyObject *r;
+
+    if (deadline == event_loop_deadline)
+	return;
+    event_loop_deadline = deadline;
+    if (!event_loop_timer_event) {
+	if (deadline >= 0 && start_event_loop_timer())
+	    PyErr_PrintEx(0);
+	return;
+    }
+    if (!(r = PyObject_CallMethod(event_loop_timer_event, "set", NULL)))
+	PyErr_PrintEx(0);
+    else
+	Py_DECREF(r);
 }
 
 static void
-free_sh_node(HashNode nodeptr)
+stop_event_loop_timer(void)
 {
-    /* Param is obtained from get_sh_item */
-    Param pm = (Param) nodeptr;
-    struct sh_key_data *sh_kdata = (struct sh_key_data *) pm->u.data;
-    PyObject *keyobj;
+    PyObject *event = event_loop_timer_event, *r;
 
-    PYTHON_INIT();
+    event_loop_deadline = -1;
+    if (!event)
+	return;
+    event_loop_timer_event = NULL;
+    if (!(r = PyObject_CallMethod(event, "set", NULL)))
+	PyErr_PrintEx(0);
+    else
+	Py_DECREF(r);
+    Py_DECREF(event);
+}
 
-    if (!(keyobj = get_string(sh_kdata->key))) {
-	ZFAIL(("While unsetting key %s of parameter %s failed to get "
-		    "key string object", sh_kdata->key, pm->node.nam), );
+/* Loop has no public API telling whether callbacks are ready or when the next 
+ * timer is due, so ready queue and scheduled heap of asyncio.BaseEventLoop 
+ * (_ready and _scheduled, present in all CPython versions since 3.4) are 
+ * inspected. If they are missing no timer is waited for: timers then only run 
+ * when something else wakes the loop up. */
+static void
+schedule_event_loop_wakeup(void)
+{
+    PyObject *ready, *scheduled, *when;
+    Py_ssize_t len;
+    double deadline;
+
+    if (!(ready = PyObject_GetAttrString(event_loop, "_ready"))) {
+	PyErr_Clear();
+	set_event_loop_deadline(-1);
+	return;
     }
-    if (PyMapping_DelItem(sh_kdata->obj, keyobj) == -1) {
-	Py_DECREF(keyobj);
-	ZFAIL(("Failed to delete key %s of parameter %s",
-		    sh_kdata->key, pm->node.nam), );
+    len = PyObject_Length(ready);
+    Py_DECREF(ready);
+    if (len > 0) {
+	set_event_loop_deadline(-1);
+	wake_event_loop();
+	return;
     }
-    Py_DECREF(keyobj);
-
-    PYTHON_FINISH;
-}
-
-static const struct gsu_scalar special_string_gsu =
-{get_special_string, set_special_string, stdunsetfn};
-static const struct gsu_integer special_integer_gsu =
-{get_special_integer, set_special_integer, unsetfn};
-static const struct gsu_float special_float_gsu =
-{get_special_float, set_special_float, unsetfn};
-static const struct gsu_array special_array_gsu =
-{get_special_array, set_special_array, stdunsetfn};
-static const struct gsu_hash special_hash_gsu =
-{hashgetfn, set_special_hash, stdunsetfn};
+    PyErr_Clear();
 
-static int
-check_special_name(char *name)
-{
-    /* Needing strncasecmp, but the one that ignores locale */
-    if (!(         (name[0] == 'z' || name[0] == 'Z')
-		&& (name[1] == 'p' || name[1] == 'P')
-		&& (name[2] == 'y' || name[2] == 'Y')
-		&& (name[3] == 't' || name[3] == 'T')
-		&& (name[4] == 'h' || name[4] == 'H')
-		&& (name[5] == 'o' || name[5] == 'O')
-		&& (name[6] == 'n' || name[6] == 'N')
-		&& (name[7] != '\0')
-       ) || !isident(name))
-    {
-	PyErr_SetString(PyExc_KeyError, "Invalid special identifier: "
-		"it must be a valid variable name starting with "
-		"\"zpython\" (ignoring case) and containing at least one more "
-		"character");
-	return 1;
+    if (!(scheduled = PyObject_GetAttrString(event_loop, "_scheduled"))) {
+	PyErr_Clear();
+	set_event_loop_deadline(-1);
+	return;
     }
-    return 0;
+    if (!PyList_Check(scheduled) || !PyList_GET_SIZE(scheduled)) {
+	Py_DECREF(scheduled);
+	set_event_loop_deadline(-1);
+	return;
+    }
+    when = PyObject_CallMethod(PyList_GET_ITEM(scheduled, 0), "when", NULL);
+    Py_DECREF(scheduled);
+    if (!when) {
+	PyErr_PrintEx(0);
+	return;
+    }
+    deadline = PyFloat_AsDouble(when);
+    Py_DECREF(when);
+    if (deadline == -1 && PyErr_Occurred()) {
+	PyErr_PrintEx(0);
+	return;
+    }
+    /* Loop clock may start at zero, keep deadline non-negative */
+    set_event_loop_deadline(deadline < 0 ? 0 : deadline);
 }
 
-static PyObject *
-set_special_parameter(PyObject *args, int type)
+static int
+start_event_loop(void)
 {
-    char *name;
-    PyObject *obj;
-    Param pm;
-    int flags = type;
-    struct special_data *data;
-    struct specialparam *sp;
-
-    if (!PyArg_ParseTuple(args, "sO", &name, &obj))
-	return NULL;
+    PyObject *asyncio, *selectors, *selector, *fdobj, *loop, *r;
+    char *buf;
+    long fd;
 
-    if (check_special_name(name))
-	return NULL;
+    if (!(selectors = PyImport_ImportModule("selectors")))
+	return 1;
+    selector = PyObject_CallMethod(selectors, "DefaultSelector", NULL);
+    Py_DECREF(selectors);
+    if (!selector)
+	return 1;
 
-    switch (type) {
-    case PM_SCALAR:
-	break;
-    case PM_INTEGER:
-    case PM_EFLOAT:
-    case PM_FFLOAT:
-	if (!PyNumber_Check(obj)) {
-	    PyErr_SetString(PyExc_TypeError,
-		    "Object must implement numeric protocol");
-	    return NULL;
-	}
-	break;
-    case PM_ARRAY:
-	if (!PySequence_Check(obj)) {
-	    PyErr_SetString(PyExc_TypeError,
-		    "Object must implement sequence protocol");
-	    return NULL;
+    if (!(fdobj = PyObject_CallMethod(selector, "fileno", NULL))) {
+	Py_DECREF(selector);
+	if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+	    PyErr_Clear();
+	    PyErr_SetString(PyExc_NotImplementedError,
+		    "Default selector has no file descriptor to watch");
 	}
-	break;
-    case PM_HASHED:
-	if (!PyMapping_Check(obj)) {
-	    PyErr_SetString(PyExc_TypeError,
-		    "Object must implement mapping protocol");
-	    return NULL;
-	}
-	break;
+	return 1;
+    }
+    fd = PyLong_AsLong(fdobj);
+    Py_DECREF(fdobj);
+    if (fd == -1 && PyErr_Occurred()) {
+	Py_DECREF(selector);
+	return 1;
     }
 
-    if (type == PM_HASHED) {
-	if (!(pm = createspecialhash(name, get_sh_item,
-				    scan_special_hash, flags))) {
-	    PyErr_SetString(PyExc_RuntimeError, "Failed to create parameter");
-	    return NULL;
-	}
+    if (!(asyncio = PyImport_ImportModule("asyncio"))) {
+	Py_DECREF(selector);
+	return 1;
     }
-    else {
-	if (!(pm = createparam(name, flags))) {
-	    PyErr_SetString(PyExc_RuntimeError, "Failed to create parameter");
-	    return NULL;
-	}
+    loop = PyObject_CallMethod(asyncio, "SelectorEventLoop", "O", selector);
+    Py_DECREF(selector);
+    if (!loop) {
+	Py_DECREF(asyncio);
+	return 1;
     }
-
-    sp = PyMem_New(struct specialparam, 1);
-    sp->prev = last_assigned_param;
-    if (last_assigned_param)
-	last_assigned_param->next = sp;
-    else
-	first_assigned_param = sp;
-    last_assigned_param = sp;
-    sp->next = NULL;
-    sp->name = ztrdup(name);
-    sp->pm = pm;
-
-    if (type != PM_HASHED) {
-	data = PyMem_New(struct special_data, 1);
-	data->sp = sp;
-	data->obj = obj;
-	Py_INCREF(obj);
-	pm->u.data = data;
+    r = PyObject_CallMethod(asyncio, "set_event_loop", "O", loop);
+    Py_DECREF(asyncio);
+    if (!r) {
+	Py_DECREF(loop);
+	return 1;
     }
+    Py_DECREF(r);
 
-    pm->level = 0;
+    /* call_soon_threadsafe with noop callback writes to the loop self-pipe */
+    if (!(event_loop_noop_obj = PyCFunction_New(&event_loop_noop_def, NULL))
+	    || !(event_loop_wakeup = PyObject_GetAttrString(loop,
+		    "call_soon_threadsafe"))) {
+	Py_CLEAR(event_loop_noop_obj);
+	Py_DECREF(loop);
+	return 1;
+    }
 
-    switch (type) {
-    case PM_SCALAR:
-	pm->gsu.s = &special_string_gsu;
-	break;
-    case PM_INTEGER:
-	pm->gsu.i = &special_integer_gsu;
-	break;
-    case PM_EFLOAT:
-    case PM_FFLOAT:
-	pm->gsu.f = &special_float_gsu;
-	break;
-    case PM_ARRAY:
-	pm->gsu.a = &special_array_gsu;
-	break;
-    case PM_HASHED:
-	{
-	    struct obj_hash_node *ohn;
-	    HashTable ht = pm->u.hash;
-	    ohn = PyMem_New(struct obj_hash_node, 1);
-	    ohn->nam = ztrdup("obj");
-	    ohn->obj = obj;
-	    Py_INCREF(obj);
-	    ohn->sp = sp;
-	    zfree(ht->nodes, ht->hsize * sizeof(HashNode));
-	    ht->nodes = (HashNode *) zshcalloc(1 * sizeof(HashNode));
-	    ht->hsize = 1;
-	    *ht->nodes = (struct hashnode *) ohn;
-	    pm->gsu.h = &special_hash_gsu;
-	    ht->freenode = free_sh_node;
-	    break;
-	}
+    buf = zhalloc(sizeof(EVENT_LOOP_START) + DIGBUFSIZE);
+    sprintf(buf, EVENT_LOOP_START, fd);
+    execstring(buf, 1, 0, ZPYTHON_COMMAND_NAME);
+    if (lastval) {
+	Py_CLEAR(event_loop_wakeup);
+	Py_CLEAR(event_loop_noop_obj);
+	Py_DECREF(loop);
+	PyErr_SetString(PyExc_RuntimeError,
+		"Failed to watch event loop file descriptor with zle -F");
+	return 1;
     }
 
-    Py_RETURN_NONE;
-}
+    event_loop = loop;
+    event_loop_fd = (int) fd;
 
-static PyObject *
-ZshSetMagicString(UNUSED(PyObject *self), PyObject *args)
-{
-    return set_special_parameter(args, PM_SCALAR);
+    return 0;
 }
 
-static PyObject *
-ZshSetMagicInteger(UNUSED(PyObject *self), PyObject *args)
+static void
+stop_event_loop(void)
 {
-    return set_special_parameter(args, PM_INTEGER);
-}
+    PyObject *r;
+    char *buf;
 
-static PyObject *
-ZshSetMagicFloat(UNUSED(PyObject *self), PyObject *args)
-{
-    return set_special_parameter(args, PM_EFLOAT);
+    if (!event_loop)
+	return;
+
+    stop_event_loop_timer();
+    buf = zhalloc(sizeof(EVENT_LOOP_STOP) + DIGBUFSIZE);
+    sprintf(buf, EVENT_LOOP_STOP, event_loop_fd);
+    execstring(buf, 1, 0, ZPYTHON_COMMAND_NAME);
+    if (!(r = PyObject_CallMethod(event_loop, "close", NULL)))
+	PyErr_PrintEx(0);
+    else
+	Py_DECREF(r);
+    Py_CLEAR(event_loop_wakeup);
+    Py_CLEAR(event_loop_noop_obj);
+    Py_CLEAR(event_loop);
+    event_loop_fd = -1;
 }
+#endif
 
-static PyObject *
-ZshSetMagicArray(UNUSED(PyObject *self), PyObject *args)
+static int
+run_event_loop_once(char *nam, char **args)
 {
-    return set_special_parameter(args, PM_ARRAY);
+#if PY_VERSION_HEX >= 0x03040000
+    PyObject *stop, *r;
+
+    if (*args) {
+	zwarnnam(nam, "too many arguments");
+	return 1;
+    }
+    if (!event_loop)
+	return 0;
+
+    PYTHON_INIT(1);
+
+    /* Stopping loop before running it makes it poll once with zero timeout 
+     * and run ready callbacks */
+    if (!(stop = PyObject_GetAttrString(event_loop, "stop")))
+	r = NULL;
+    else {
+	r = PyObject_CallMethod(event_loop, "call_soon", "O", stop);
+	Py_DECREF(stop);
+    }
+    if (r) {
+	Py_DECREF(r);
+	r = PyObject_CallMethod(event_loop, "run_forever", NULL);
+    }
+    if (!r)
+	PyErr_PrintEx(0);
+    else
+	Py_DECREF(r);
+    schedule_event_loop_wakeup();
+
+    PYTHON_FINISH;
+    return 0;
+#else
+    zwarnnam(nam, "event loop needs Python 3.4 or later");
+    return 1;
+#endif
 }
 
 static PyObject *
-ZshSetMagicHash(UNUSED(PyObject *self), PyObject *args)
+ZshEventLoop(UNUSED(PyObject *self), UNUSED(PyObject *args))
 {
-    return set_special_parameter(args, PM_HASHED);
+    if (check_main_thread())
+	return NULL;
+
+#if PY_VERSION_HEX >= 0x03040000
+    if (!event_loop && start_event_loop())
+	return NULL;
+    Py_INCREF(event_loop);
+    return event_loop;
+#else
+    PyErr_SetString(PyExc_NotImplementedError,
+	    "Event loop needs Python 3.4 or later");
+    return NULL;
+#endif
 }
 
 static struct PyMethodDef ZshMethods[] = {
@@ -1372,11 +6722,39 @@ static struct PyMethodDef ZshMethods[] = {
 	"Throws KeyError   if identifier is invalid,\n"
 	"       IndexError if parameter was not found\n"
     },
+    {"getview", ZshGetView, METH_VARARGS,
+	"Get a mapping viewing associative array with the given name in place\n"
+	"a read-only sequence viewing an array or a read-only buffer viewing\n"
+	"a scalar.\n"
+	"Without argument view is over the parameter table: its values are the\n"
+	"ones getvalue returns. Only accessed elements are converted.\n"
+	"Throws the same exceptions as getvalue and TypeError for other types\n"
+    },
+    {"getvalues", ZshGetValues, METH_O,
+	"Get values of several parameters at once. Takes an iterable of names and\n"
+	"returns a dict mapping them to values of the same types as getvalue\n"
+	"returns. If some parameters failed one exception listing all of them is\n"
+	"thrown, its type is the type of the first error getvalue would throw\n"
+    },
     {"expand", ZshExpand, METH_VARARGS,
 	"Perform process substitution, parameter substitution and command substitution on\n"
 	"its argument and return the result."},
     {"glob", ZshGlob, METH_VARARGS,
 	"Perform globbing on its argument and return the result as a list."},
+    {"iglob", (PyCFunction) ZshIGlob, METH_VARARGS|METH_KEYWORDS,
+	"Perform globbing on its argument and return an iterator over matches,\n"
+	"converted when reached. With limit globbing stops after that many\n"
+	"matches are found; matches are then not sorted."},
+    {"glob_stat", ZshGlobStat, METH_VARARGS,
+	"Perform globbing on its argument and return a list of entries with\n"
+	"path, size, mode, mtime and type attributes, stat is called once per\n"
+	"match."},
+    {"glob_many", (PyCFunction) ZshGlobMany, METH_VARARGS|METH_KEYWORDS,
+	"Perform globbing on each pattern from iterable and return a list with\n"
+	"list of matches for each of them. Each directory is read once for all\n"
+	"patterns matching names in it, with cache=True its listing is kept\n"
+	"while the directory is not modified. Patterns without matches do not\n"
+	"stop the rest, one ValueError listing all of them is thrown at the end."},
     {"setvalue", ZshSetValue, METH_VARARGS,
 	"Set parameter value. Use None to unset. Supported objects and corresponding\n"
 	"zsh parameter types:\n"
@@ -1395,36 +6773,57 @@ static struct PyMethodDef ZshMethods[] = {
 	"       RuntimeError if zsh set?param/unsetparam function failed,\n"
 	"       ValueError   if sequence item or dictionary key or value are not str\n"
 	"                       or sequence size is not known."},
-    {"set_special_string", ZshSetMagicString, METH_VARARGS,
+    {"setvalues", ZshSetValues, METH_O,
+	"Set several parameters at once. Takes a mapping of names to values which\n"
+	"are treated as by setvalue. Parameters are set in mapping order; failing\n"
+	"ones do not stop the rest from being set, instead one exception listing\n"
+	"all of them is thrown at the end, its type is the type of the first error."},
+    {"set_special_string", (PyCFunction) ZshSetMagicString,
+	METH_VARARGS | METH_KEYWORDS,
 	"Define scalar (string) parameter.\n"
 	"First argument is parameter name, it must start with zpython (case is ignored).\n"
 	"  Parameter with given name must not exist.\n"
 	"Second argument is value object. Its __str__ method will be used to get\n"
 	"  resulting string when parameter is accessed in zsh, __call__ method will be used\n"
-	"  to set value. If object is not callable then parameter will be considered readonly"},
-    {"set_special_integer", ZshSetMagicInteger, METH_VARARGS,
+	"  to set value. If object is not callable then parameter will be considered readonly\n"
+	"Optional cache argument enables caching of the converted value:\n"
+	"  True      until zsh.invalidate() or assignment from zsh\n"
+	"  number    also at most that number of seconds\n"
+	"  \"prompt\"  also until the next precmd\n"
+	"  \"async\"   return the last value immediately, recompute it in the\n"
+	"            background thread on the first access after precmd\n"
+	"on_update argument of asynchronous parameters is called from the\n"
+	"  background thread with parameter name after each recomputation"},
+    {"set_special_integer", (PyCFunction) ZshSetMagicInteger,
+	METH_VARARGS | METH_KEYWORDS,
 	"Define integer parameter.\n"
 	"First argument is parameter name, it must start with zpython (case is ignored).\n"
 	"  Parameter with given name must not exist.\n"
 	"Second argument is value object. It will be coerced to long integer,\n"
 	"  __call__ method will be used to set value. If object is not callable\n"
-	"  then parameter will be considered readonly"},
-    {"set_special_float", ZshSetMagicFloat, METH_VARARGS,
+	"  then parameter will be considered readonly\n"
+	"Optional cache argument is the same as for set_special_string"},
+    {"set_special_float", (PyCFunction) ZshSetMagicFloat,
+	METH_VARARGS | METH_KEYWORDS,
 	"Define floating point parameter.\n"
 	"First argument is parameter name, it must start with zpython (case is ignored).\n"
 	"  Parameter with given name must not exist.\n"
 	"Second argument is value object. It will be coerced to float,\n"
 	"  __call__ method will be used to set value. If object is not callable\n"
-	"  then parameter will be considered readonly"},
-    {"set_special_array", ZshSetMagicArray, METH_VARARGS,
+	"  then parameter will be considered readonly\n"
+	"Optional cache argument is the same as for set_special_string"},
+    {"set_special_array", (PyCFunction) ZshSetMagicArray,
+	METH_VARARGS | METH_KEYWORDS,
 	"Define array parameter.\n"
 	"First argument is parameter name, it must start with zpython (case is ignored).\n"
 	"  Parameter with given name must not exist.\n"
 	"Second argument is value object. It must implement sequence protocol,\n"
 	"  each item in sequence must have str type, __call__ method will be used\n"
 	"  to set value. If object is not callable then parameter will be\n"
-	"  considered readonly"},
-    {"set_special_hash", ZshSetMagicHash, METH_VARARGS,
+	"  considered readonly\n"
+	"Optional cache argument is the same as for set_special_string"},
+    {"set_special_hash", (PyCFunction) ZshSetMagicHash,
+	METH_VARARGS | METH_KEYWORDS,
 	"Define hash parameter.\n"
 	"First argument is parameter name, it must start with zpython (case is ignored).\n"
 	"  Parameter with given name must not exist.\n"
@@ -1433,6 +6832,63 @@ static struct PyMethodDef ZshMethods[] = {
 	"  __getitem__ must be able to work with string objects,\n"
 	"  each item must have str type.\n"
 	"  __setitem__ will be used to set hash items"},
+    {"invalidate", ZshInvalidate, METH_VARARGS,
+	"Drop cached value of the given special parameter or of all special\n"
+	"parameters if called without arguments.\n"
+	"Throws KeyError if special parameter with given name does not exist"},
+    {"define_builtin", ZshDefineBuiltin, METH_VARARGS,
+	"Define zsh builtin which calls given callable with the list of arguments.\n"
+	"Callable returns exit status: None or True for 0, False for 1 or an int.\n"
+	"If it returns a str it is assigned to $REPLY and status is 0, (status,\n"
+	"reply) tuple sets both. Defining existing Python builtin replaces callable.\n"
+	"Throws ValueError if builtin with the same name already exists"},
+    {"undefine_builtin", ZshUndefineBuiltin, METH_VARARGS,
+	"Remove builtin defined by define_builtin.\n"
+	"Throws KeyError if builtin was not defined by define_builtin"},
+    {"add_hook", ZshAddHook, METH_VARARGS,
+	"Add callable to zsh hook: chpwd, periodic, precmd, preexec, zshaddhistory\n"
+	"or zshexit. Callable receives hook arguments, its return value is used as\n"
+	"hook exit status like for define_builtin. Python hooks of one kind run in\n"
+	"order they were added, after functions which were in ${kind}_functions\n"
+	"array when first hook of this kind was added"},
+    {"remove_hook", ZshRemoveHook, METH_VARARGS,
+	"Remove callable added by add_hook.\n"
+	"Throws ValueError if it was not added"},
+    {"event_loop", ZshEventLoop, METH_NOARGS,
+	"Get asyncio event loop run by zle while shell waits for input. Loop is\n"
+	"created and set as the current event loop on the first call.\n"
+	"Throws NotImplementedError with Python older than 3.4"},
+    {"timings", ZshTimings, METH_NOARGS,
+	"Get information about time spent while loading module.\n"
+	"Returns a dict with the following values:\n"
+	"  init            seconds spent initializing interpreter (float)\n"
+	"  lazy            True if interpreter was initialized on first use\n"
+	"  preload_wait    seconds first zpython call waited for preloading\n"
+	"  hooks           dict mapping hook kinds to lists of (callable, calls,\n"
+	"                  seconds) tuples for hooks added by add_hook\n"
+	"If $ZPYTHON_PRELOAD was set also:\n"
+	"  preload         dict mapping preloaded modules to import time\n"
+	"  preload_total   seconds spent by preload thread\n"
+	"  preload_failed  list of modules that failed to import"},
+    {"meta_kernel", ZshMetaKernel, METH_VARARGS,
+	"Get or set the kernel used to convert strings between zsh and Python.\n"
+	"With an argument selects the kernel: \"scalar\", \"sse2\" or \"avx2\".\n"
+	"Throws ValueError if it is not supported. Returns name of the current kernel"},
+    {"code_cache_info", ZshCodeCacheInfo, METH_NOARGS,
+	"Get statistics of the cache of code objects compiled by zpython builtin.\n"
+	"Returns a dict with the following int values:\n"
+	"  hits       number of times cached code object was reused\n"
+	"  misses     number of times code had to be compiled\n"
+	"  evictions  number of entries dropped because cache was full\n"
+	"  size       number of entries currently in cache\n"
+	"  capacity   maximum number of entries ($ZPYTHON_CODE_CACHE_SIZE)"},
+    {"code_cache_clear", ZshCodeCacheClear, METH_NOARGS,
+	"Drop all code objects cached by zpython builtin. Statistics is kept."},
+    {"code_cache_save", ZshCodeCacheSave, METH_VARARGS,
+	"Save cached code objects to the given file so that they can be loaded\n"
+	"by setting $ZPYTHON_CODE_CACHE_FILE before loading module.\n"
+	"Argument defaults to $ZPYTHON_CODE_CACHE_FILE value. Throws OSError\n"
+	"if file could not be written."},
     {NULL, NULL, 0, NULL},
 };
 
@@ -1451,6 +6907,9 @@ EnvironGeneratorNext(PyObject *self)
 {
     EnvironGeneratorObject *this = (EnvironGeneratorObject *) self;
 
+    if (check_main_thread())
+	return NULL;
+
     if (*this->environ == NULL)
 	return NULL;
 
@@ -1517,18 +6976,27 @@ static PyTypeObject EnvironType;
 static PyObject *
 EnvironKeys(UNUSED(PyObject *self))
 {
+    if (check_main_thread())
+	return NULL;
+
     return EnvironGeneratorNew(EnvironGetKey);
 }
 
 static PyObject *
 EnvironValues(UNUSED(PyObject *self))
 {
+    if (check_main_thread())
+	return NULL;
+
     return EnvironGeneratorNew(EnvironGetValue);
 }
 
 static PyObject *
 EnvironItems(UNUSED(PyObject *self))
 {
+    if (check_main_thread())
+	return NULL;
+
     return EnvironGeneratorNew(EnvironGetItem);
 }
 
@@ -1536,8 +7004,13 @@ static PyObject *
 EnvironCopy(UNUSED(PyObject *self))
 {
     char **e;
-    PyObject *d = PyDict_New();
+    PyObject *d;
+
+    if (check_main_thread())
+	return NULL;
 
+    if (!(d = PyDict_New()))
+	return NULL;
     for (e = environ; *e != NULL; e++) {
 	PyObject *k;
 	PyObject *v;
@@ -1575,6 +7048,9 @@ EnvironPop(UNUSED(PyObject *self), PyObject *args)
     Param pm;
     PyObject *def = NULL;
 
+    if (check_main_thread())
+	return NULL;
+
     if (!PyArg_ParseTuple(args, "s|O", &var, &def))
 	return NULL;
 
@@ -1621,6 +7097,9 @@ EnvironGet(UNUSED(PyObject *self), PyObject *args)
     Param pm;
     PyObject *def = NULL;
 
+    if (check_main_thread())
+	return NULL;
+
     if (!PyArg_ParseTuple(args, "s|O", &var, &def))
 	return NULL;
 
@@ -1697,6 +7176,9 @@ EnvironContains(UNUSED(PyObject *self), PyObject *keyObject)
 {
     char *var;
 
+    if (check_main_thread())
+	return -1;
+
     if (!(var = get_no_null_chars(keyObject)))
 	return -1;
 
@@ -1712,6 +7194,9 @@ EnvironItem(UNUSED(PyObject *self), PyObject *keyObject)
     char *var;
     char *val;
 
+    if (check_main_thread())
+	return NULL;
+
     if (!(var = get_no_null_chars(keyObject)))
 	return NULL;
 
@@ -1726,6 +7211,9 @@ EnvironItem(UNUSED(PyObject *self), PyObject *keyObject)
 static PyObject *
 EnvironAssItem(PyObject *self, PyObject *keyObject, PyObject *valObject)
 {
+    if (check_main_thread())
+	return NULL;
+
     if (valObject == NULL) {
 	PyObject *args;
 	PyObject *item;
@@ -1760,6 +7248,9 @@ EnvironLength(UNUSED(PyObject *self))
     char **e;
     Py_ssize_t r = 0;
 
+    if (check_main_thread())
+	return -1;
+
     for(e = environ; *e != NULL; e++)
 	r++;
 
@@ -1800,6 +7291,121 @@ init_types(void)
     EnvironGeneratorType.tp_iternext = EnvironGeneratorNext;
     EnvironGeneratorType.tp_flags = Py_TPFLAGS_DEFAULT;
 
+    memset(&CellType, 0, sizeof(CellType));
+    CellType.tp_name = "zsh.Cell";
+    CellType.tp_basicsize = sizeof(CellObject);
+    CellType.tp_getattro = PyObject_GenericGetAttr;
+    CellType.tp_methods = CellMethods;
+    CellType.tp_new = CellNew;
+    CellType.tp_dealloc = CellDealloc;
+    CellType.tp_call = CellCall;
+    CellType.tp_flags = Py_TPFLAGS_DEFAULT;
+    CellType.tp_doc = "Cell(value)\n"
+	"Native value cell: special parameter bound to it with set_special_string,\n"
+	"set_special_integer or set_special_float is read by zsh without\n"
+	"interpreter. Type of the initial value (str, int or float) selects\n"
+	"the type of the cell.";
+
+    memset(&WidgetType, 0, sizeof(WidgetType));
+    WidgetType.tp_name = "zsh.zle.Widget";
+    WidgetType.tp_basicsize = sizeof(WidgetObject);
+    WidgetType.tp_getattro = PyObject_GenericGetAttr;
+    WidgetType.tp_setattro = PyObject_GenericSetAttr;
+    WidgetType.tp_getset = WidgetGetSet;
+    WidgetType.tp_dealloc = (destructor) PyObject_Del;
+    WidgetType.tp_flags = Py_TPFLAGS_DEFAULT;
+    WidgetType.tp_doc = "Context of the running zle widget";
+
+    memset(&WriterType, 0, sizeof(WriterType));
+    WriterType.tp_name = "zsh.Writer";
+    WriterType.tp_basicsize = sizeof(WriterObject);
+    WriterType.tp_getattro = PyObject_GenericGetAttr;
+    WriterType.tp_setattro = PyObject_GenericSetAttr;
+    WriterType.tp_methods = WriterMethods;
+    WriterType.tp_getset = WriterGetSet;
+    WriterType.tp_dealloc = (destructor) WriterDealloc;
+    WriterType.tp_flags = Py_TPFLAGS_DEFAULT;
+    WriterType.tp_doc = "Unbuffered writer to zsh file descriptor";
+
+    memset(&HashViewType, 0, sizeof(HashViewType));
+    HashViewType.tp_name = "zsh.HashView";
+    HashViewType.tp_basicsize = sizeof(HashViewObject);
+    HashViewType.tp_getattro = PyObject_GenericGetAttr;
+    HashViewType.tp_methods = HashViewMethods;
+    HashViewType.tp_as_sequence = &HashViewAsSeq;
+    HashViewType.tp_as_mapping = &HashViewAsMapping;
+    HashViewType.tp_iter = (getiterfunc) HashViewIter;
+    HashViewType.tp_dealloc = (destructor) HashViewDealloc;
+    HashViewType.tp_flags = Py_TPFLAGS_DEFAULT;
+    HashViewType.tp_doc = "Mapping viewing zsh associative array in place";
+
+    memset(&ArrayViewType, 0, sizeof(ArrayViewType));
+    ArrayViewType.tp_name = "zsh.ArrayView";
+    ArrayViewType.tp_basicsize = sizeof(ArrayViewObject);
+    ArrayViewType.tp_getattro = PyObject_GenericGetAttr;
+    ArrayViewType.tp_methods = ArrayViewMethods;
+    ArrayViewType.tp_as_sequence = &ArrayViewAsSeq;
+    ArrayViewType.tp_as_mapping = &ArrayViewAsMapping;
+    ArrayViewType.tp_iter = (getiterfunc) ArrayViewIter;
+    ArrayViewType.tp_dealloc = (destructor) ArrayViewDealloc;
+    ArrayViewType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ArrayViewType.tp_doc = "Sequence viewing zsh array in place";
+
+    memset(&ScalarViewAsBuffer, 0, sizeof(ScalarViewAsBuffer));
+    ScalarViewAsBuffer.bf_getbuffer = (getbufferproc) ScalarViewGetBuffer;
+    ScalarViewAsBuffer.bf_releasebuffer =
+	(releasebufferproc) ScalarViewReleaseBuffer;
+
+    memset(&ScalarViewType, 0, sizeof(ScalarViewType));
+    ScalarViewType.tp_name = "zsh.ScalarView";
+    ScalarViewType.tp_basicsize = sizeof(ScalarViewObject);
+    ScalarViewType.tp_getattro = PyObject_GenericGetAttr;
+    ScalarViewType.tp_as_buffer = &ScalarViewAsBuffer;
+    ScalarViewType.tp_dealloc = (destructor) ScalarViewDealloc;
+#if PY_MAJOR_VERSION < 3
+    ScalarViewType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER;
+#else
+    ScalarViewType.tp_flags = Py_TPFLAGS_DEFAULT;
+#endif
+    ScalarViewType.tp_doc = "Read-only buffer viewing zsh scalar in place";
+
+    memset(&GlobEntryType, 0, sizeof(GlobEntryType));
+    GlobEntryType.tp_name = "zsh.GlobEntry";
+    GlobEntryType.tp_basicsize = sizeof(GlobEntryObject);
+    GlobEntryType.tp_getattro = PyObject_GenericGetAttr;
+    GlobEntryType.tp_getset = GlobEntryGetSet;
+    GlobEntryType.tp_repr = (reprfunc) GlobEntryRepr;
+    GlobEntryType.tp_dealloc = (destructor) GlobEntryDealloc;
+    GlobEntryType.tp_flags = Py_TPFLAGS_DEFAULT;
+    GlobEntryType.tp_doc = "Match of zsh.glob_stat with its stat data";
+
+    memset(&GlobIterType, 0, sizeof(GlobIterType));
+    GlobIterType.tp_name = "zsh.GlobIterator";
+    GlobIterType.tp_basicsize = sizeof(GlobIterObject);
+    GlobIterType.tp_getattro = PyObject_GenericGetAttr;
+    GlobIterType.tp_iter = GlobIterIter;
+    GlobIterType.tp_iternext = (iternextfunc) GlobIterNext;
+    GlobIterType.tp_dealloc = (destructor) GlobIterDealloc;
+    GlobIterType.tp_flags = Py_TPFLAGS_DEFAULT;
+
+    memset(&HashViewIterType, 0, sizeof(HashViewIterType));
+    HashViewIterType.tp_name = "zsh.HashViewIterator";
+    HashViewIterType.tp_basicsize = sizeof(HashViewIterObject);
+    HashViewIterType.tp_getattro = PyObject_GenericGetAttr;
+    HashViewIterType.tp_iter = HashViewIterIter;
+    HashViewIterType.tp_iternext = (iternextfunc) HashViewIterNext;
+    HashViewIterType.tp_dealloc = (destructor) HashViewIterDealloc;
+    HashViewIterType.tp_flags = Py_TPFLAGS_DEFAULT;
+
+    memset(&ArrayViewIterType, 0, sizeof(ArrayViewIterType));
+    ArrayViewIterType.tp_name = "zsh.ArrayViewIterator";
+    ArrayViewIterType.tp_basicsize = sizeof(ArrayViewIterObject);
+    ArrayViewIterType.tp_getattro = PyObject_GenericGetAttr;
+    ArrayViewIterType.tp_iter = ArrayViewIterIter;
+    ArrayViewIterType.tp_iternext = (iternextfunc) ArrayViewIterNext;
+    ArrayViewIterType.tp_dealloc = (destructor) ArrayViewIterDealloc;
+    ArrayViewIterType.tp_flags = Py_TPFLAGS_DEFAULT;
+
     memset(&EnvironType, 0, sizeof(EnvironType));
     EnvironType.tp_name = "zsh.environ";
     EnvironType.tp_basicsize = sizeof(EnvironObject);
@@ -1814,6 +7420,26 @@ init_types(void)
 	return 1;
     if (PyType_Ready(&EnvironType) == -1)
 	return 1;
+    if (PyType_Ready(&CellType) == -1)
+	return 1;
+    if (PyType_Ready(&WidgetType) == -1)
+	return 1;
+    if (PyType_Ready(&WriterType) == -1)
+	return 1;
+    if (PyType_Ready(&HashViewType) == -1)
+	return 1;
+    if (PyType_Ready(&HashViewIterType) == -1)
+	return 1;
+    if (PyType_Ready(&ArrayViewType) == -1)
+	return 1;
+    if (PyType_Ready(&ArrayViewIterType) == -1)
+	return 1;
+    if (PyType_Ready(&ScalarViewType) == -1)
+	return 1;
+    if (PyType_Ready(&GlobIterType) == -1)
+	return 1;
+    if (PyType_Ready(&GlobEntryType) == -1)
+	return 1;
     return 0;
 }
 
@@ -1829,10 +7455,22 @@ static struct PyModuleDef zshmodule = {
     NULL,       /* A clear function to call during GC clearing */
     NULL,       /* A function to call during deallocation */
 };
+
+static struct PyModuleDef zlemodule = {
+    PyModuleDef_HEAD_INIT,
+    "zsh.zle",  /* Module name */
+    NULL,       /* Module documentation */
+    -1,         /* Size of additional memory needed (no memory needed) */
+    ZleMethods, /* Module methods */
+    NULL,       /* Unused, should be null. Name: m_reload, type: inquiry */
+    NULL,       /* A traversal function to call during GC traversal */
+    NULL,       /* A clear function to call during GC clearing */
+    NULL,       /* A function to call during deallocation */
+};
 #endif
 
 static struct builtin bintab[] = {
-    BUILTIN(ZPYTHON_COMMAND_NAME, 0, do_zpython,  1, 1, 0, NULL, NULL),
+    BUILTIN(ZPYTHON_COMMAND_NAME, 0, do_zpython,  0, -1, 0, "efiHw", NULL),
 };
 
 static struct features module_features = {
@@ -1869,6 +7507,7 @@ static int
 zsh_init_globals(PyObject *zsh_globals)
 {
     EnvironObject *environ;
+    PyObject *zle;
 
     if (init_types())
 	return 1;
@@ -1878,6 +7517,24 @@ zsh_init_globals(PyObject *zsh_globals)
 
     if (PyDict_SetItemString(zsh_globals, "environ", (PyObject *)environ) == -1)
 	return 1;
+    if (PyDict_SetItemString(zsh_globals, "Cell", (PyObject *) &CellType) == -1)
+	return 1;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!(zle = PyModule_Create(&zlemodule)))
+	return 1;
+#else
+    /* Module is borrowed reference here */
+    if (!(zle = Py_InitModule("zsh.zle", ZleMethods)))
+	return 1;
+    Py_INCREF(zle);
+#endif
+    if (PyDict_SetItemString(PyImport_GetModuleDict(), "zsh.zle", zle) == -1
+	    || PyDict_SetItemString(zsh_globals, "zle", zle) == -1) {
+	Py_DECREF(zle);
+	return 1;
+    }
+    Py_DECREF(zle);
     return 0;
 }
 
@@ -1902,46 +7559,572 @@ PyInit_zsh()
     return module;
 }
 
-/**/
-int
-boot_(UNUSED(Module m))
+static size_t
+get_boot_size(char *name, size_t def)
+{
+    char *s = getsparam(name);
+    zlong r;
+
+    if (!s || !*s)
+	return def;
+
+    r = zstrtol(s, NULL, 10);
+    return r < 0 ? 0 : (size_t) r;
+}
+
+/* Returns words of the given parameter in heap memory or NULL if it is not 
+ * set. Parameter may be either an array or a scalar with words separated by 
+ * spaces or commas. */
+static char **
+get_boot_words(char *name)
+{
+    char *s, *p, **words, **w;
+    int n = 0;
+
+    if ((words = getaparam(name)))
+	return words;
+    if (!(s = getsparam(name)))
+	return NULL;
+
+    for (p = s; *p; n++) {
+	p += strspn(p, " ,");
+	if (!*p)
+	    break;
+	p += strcspn(p, " ,");
+    }
+
+    w = words = (char **) hcalloc((n + 1) * sizeof(char *));
+    while (*s) {
+	size_t len;
+
+	s += strspn(s, " ,");
+	if (!(len = strcspn(s, " ,")))
+	    break;
+	*w++ = dupstrpfx(s, len);
+	s += len;
+    }
+
+    return words;
+}
+
+/* Returns true if word is present in $ZPYTHON_OPTIONS. */
+static int
+has_boot_option(const char *word)
+{
+    char **words = get_boot_words("ZPYTHON_OPTIONS");
+
+    if (!words)
+	return 0;
+
+    for (; *words; words++)
+	if (!strcmp(*words, word))
+	    return 1;
+
+    return 0;
+}
+
+static double
+get_time(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    /* Cache expiry must not follow wall clock adjustments */
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1000000000.0;
+#endif
+    {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+    }
+}
+
+/* Modules listed in $ZPYTHON_PRELOAD are imported by a daemon Python thread 
+ * started after initialization while shell continues reading its startup 
+ * files. First zpython call waits for it to finish. */
+
+/* Thread body: imports modules from names tuple and saves time spent on each 
+ * one to preload_info. Import errors are only recorded in preload_failed: 
+ * there is nothing sensible to do with them while startup files are read. */
+static PyObject *
+preload_modules(UNUSED(PyObject *self), PyObject *names)
+{
+    PyObject *times, *failed, *info;
+    double start = get_time();
+    Py_ssize_t i;
+
+    if (!(times = PyDict_New()))
+	return NULL;
+    if (!(failed = PyList_New(0))) {
+	Py_DECREF(times);
+	return NULL;
+    }
+
+    for (i = 0; i < PyTuple_GET_SIZE(names); i++) {
+	PyObject *name = PyTuple_GET_ITEM(names, i);
+	PyObject *module, *t;
+	double mstart = get_time();
+
+	if (!(module = PyImport_Import(name))) {
+	    PyErr_Clear();
+	    if (PyList_Append(failed, name) == -1)
+		break;
+	    continue;
+	}
+	Py_DECREF(module);
+
+	if (!(t = PyFloat_FromDouble(get_time() - mstart)))
+	    break;
+	if (PyDict_SetItem(times, name, t) == -1) {
+	    Py_DECREF(t);
+	    break;
+	}
+	Py_DECREF(t);
+    }
+
+    if (PyErr_Occurred())
+	info = NULL;
+    else
+	info = Py_BuildValue("{s:O,s:d,s:O}",
+		"preload", times,
+		"preload_total", get_time() - start,
+		"preload_failed", failed);
+    Py_DECREF(times);
+    Py_DECREF(failed);
+    if (!info)
+	return NULL;
+
+    Py_XDECREF(preload_info);
+    preload_info = info;
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef preload_def =
+    {"zpython_preload", preload_modules, METH_O, NULL};
+
+/* Starts threading.Thread running preload_modules. Must be called with GIL 
+ * held. */
+static int
+start_preload(char **modules)
+{
+    PyObject *names, *target, *threading, *thread_class, *args, *kwargs, *r;
+    int i, n = arrlen(modules);
+
+    if (!(names = PyTuple_New(n)))
+	return 1;
+    for (i = 0; i < n; i++) {
+	PyObject *name;
+
+	if (!(name = Py_BuildValue("s", unmeta(modules[i])))) {
+	    Py_DECREF(names);
+	    return 1;
+	}
+	PyTuple_SET_ITEM(names, i, name);
+    }
+
+    if (!(target = PyCFunction_New(&preload_def, NULL))) {
+	Py_DECREF(names);
+	return 1;
+    }
+    kwargs = Py_BuildValue("{s:O,s:(O)}", "target", target, "args", names);
+    Py_DECREF(target);
+    Py_DECREF(names);
+    if (!kwargs)
+	return 1;
+
+    if (!(threading = PyImport_ImportModule("threading"))) {
+	Py_DECREF(kwargs);
+	return 1;
+    }
+    thread_class = PyObject_GetAttrString(threading, "Thread");
+    Py_DECREF(threading);
+    if (!thread_class) {
+	Py_DECREF(kwargs);
+	return 1;
+    }
+    if (!(args = PyTuple_New(0))) {
+	Py_DECREF(thread_class);
+	Py_DECREF(kwargs);
+	return 1;
+    }
+    preload_thread = PyObject_Call(thread_class, args, kwargs);
+    Py_DECREF(thread_class);
+    Py_DECREF(args);
+    Py_DECREF(kwargs);
+    if (!preload_thread)
+	return 1;
+
+    if (PyObject_SetAttrString(preload_thread, "daemon", Py_True) == -1
+	    || !(r = PyObject_CallMethod(preload_thread, "start", NULL))) {
+	Py_CLEAR(preload_thread);
+	return 1;
+    }
+    Py_DECREF(r);
+
+    return 0;
+}
+
+/* Blocks until preload thread finishes. Must be called with GIL held. */
+static void
+wait_preload(void)
 {
+    PyObject *r;
+    double start = get_time();
+
+    if (!(r = PyObject_CallMethod(preload_thread, "join", NULL)))
+	PyErr_PrintEx(0);
+    else
+	Py_DECREF(r);
+    preload_wait = get_time() - start;
+    Py_CLEAR(preload_thread);
+}
+
+/* Main thread releases the GIL right after initialization and takes it back 
+ * only in entry points, so background Python threads run while zsh is idle. 
+ * As zsh forks without Python knowing about it, GIL is taken by the main 
+ * thread around fork unless it already holds it, i.e. fork is done from an 
+ * entry point that did not release the GIL to run zsh code: otherwise child 
+ * could inherit GIL locked by a thread that does not exist there. Child 
+ * finishes reinitialization and releases the GIL in after_fork when it uses 
+ * Python. */
+static int fork_took_gil = 0;
+
+static int
+is_main_fork(void)
+{
+    return main_tstate && Py_IsInitialized()
+	&& pthread_equal(pthread_self(), main_thread);
+}
+
+static void
+fork_prepare(void)
+{
+    if (!is_main_fork())
+	return;
+    if (main_depth == main_released && !gil_taken_for_fork) {
+	PyEval_RestoreThread(main_depth ? released_tstate : main_tstate);
+	gil_taken_for_fork = fork_took_gil = 1;
+    }
+#if PY_VERSION_HEX >= 0x03070000
+    PyOS_BeforeFork();
+#endif
+}
+
+static void
+fork_parent(void)
+{
+    if (!is_main_fork())
+	return;
+#if PY_VERSION_HEX >= 0x03070000
+    PyOS_AfterFork_Parent();
+#endif
+    if (fork_took_gil) {
+	gil_taken_for_fork = fork_took_gil = 0;
+	PyEval_SaveThread();
+    }
+}
+
+static void
+fork_child(void)
+{
+    /* GIL stays with the only thread of the child until after_fork */
+    fork_took_gil = 0;
+}
+
+/* Fork handlers cannot be removed, so module is kept in memory after it is 
+ * unloaded. */
+static void
+pin_module(void)
+{
+#ifdef RTLD_NODELETE
+    Dl_info info;
+
+    if (dladdr((void *) &pin_module, &info) && info.dli_fname)
+	dlopen(info.dli_fname, RTLD_LAZY | RTLD_NODELETE);
+#endif
+}
+
+/* Without fork handlers main thread keeps the GIL and background threads 
+ * only run during entry points */
+static void
+release_main_gil(void)
+{
+    static int fork_handlers = 0;
+
+    if (!fork_handlers) {
+	pin_module();
+	if (pthread_atfork(fork_prepare, fork_parent, fork_child))
+	    return;
+	fork_handlers = 1;
+    }
+    main_tstate = PyEval_SaveThread();
+}
+
+/* Interpreter configuration selected by $ZPYTHON_OPTIONS words:
+ *   isolated        ignore PYTHON* environment variables and user site 
+ *                   directory
+ *   no-site         do not import site module
+ *   no-bytecode     do not write .pyc files
+ *   frozen-modules  use frozen standard library modules (Python 3.11+)
+ *   fast            all of the above
+ * If $ZPYTHON_PATH array is set it is used as sys.path instead of computed 
+ * one, standard library zip file may be listed there. */
+struct init_profile {
+    int isolated;
+    int no_site;
+    int no_bytecode;
+    int frozen_modules;
+    char **path;
+};
+
+static void
+get_init_profile(struct init_profile *profile)
+{
+    int fast = has_boot_option("fast");
+
+    profile->isolated = fast || has_boot_option("isolated");
+    profile->no_site = fast || has_boot_option("no-site");
+    profile->no_bytecode = fast || has_boot_option("no-bytecode");
+    profile->frozen_modules = fast || has_boot_option("frozen-modules");
+    profile->path = getaparam("ZPYTHON_PATH");
+}
+
+#if PY_MAJOR_VERSION >= 3
+static wchar_t *program_name = NULL;
+static size_t program_name_size = 0;
+
+/* Returns newly zalloc'ed wide string, size (in bytes) is stored in *sizep */
+static wchar_t *
+get_wide_string(const char *s, size_t *sizep)
+{
+    size_t len = mbstowcs(NULL, s, 0);
+    wchar_t *r;
+
+    if (len == (size_t) -1)
+	len = strlen(s);
+    *sizep = (len + 1) * sizeof(wchar_t);
+    r = (wchar_t *) zalloc(*sizep);
+    if (mbstowcs(r, s, len + 1) == (size_t) -1) {
+	/* Invalid multibyte sequence: fall back to byte-by-byte conversion */
+	size_t i;
+	for (i = 0; i < len; i++)
+	    r[i] = (wchar_t) (unsigned char) s[i];
+    }
+    r[len] = L'\0';
+    return r;
+}
+#endif
+
+#if PY_VERSION_HEX >= 0x03080000
+static int
+init_interpreter(void)
+{
+    struct init_profile profile;
+    PyPreConfig preconfig;
+    PyConfig config;
+    PyStatus status;
+    wchar_t *argv[1];
+    char **p;
+
+    get_init_profile(&profile);
+
+    if (!program_name)
+	program_name = get_wide_string(argzero, &program_name_size);
+
+    if (!profile.isolated && !profile.no_site && !profile.no_bytecode
+	    && !profile.frozen_modules && !profile.path) {
+	/* Default configuration: keep exactly the behaviour of the legacy 
+	 * API used by previous versions */
+	argv[0] = program_name;
+	Py_SetProgramName(program_name);
+	Py_InitializeEx(0);
+	PySys_SetArgvEx(1, argv, 0);
+	return 0;
+    }
+
+    /* Locale was already configured by zsh, Python must not touch it */
+    PyPreConfig_InitIsolatedConfig(&preconfig);
+    preconfig.use_environment = !profile.isolated;
+    status = Py_PreInitialize(&preconfig);
+    if (PyStatus_Exception(status))
+	goto fail;
+
+    if (profile.isolated)
+	PyConfig_InitIsolatedConfig(&config);
+    else
+	PyConfig_InitPythonConfig(&config);
+
+    config.parse_argv = 0;
+    config.install_signal_handlers = 0;
+    config.configure_c_stdio = 0;
+    if (profile.no_site)
+	config.site_import = 0;
+    if (profile.no_bytecode)
+	config.write_bytecode = 0;
+#if PY_VERSION_HEX >= 0x030B0000
+    if (profile.frozen_modules)
+	config.use_frozen_modules = 1;
+#endif
+
+    status = PyConfig_SetString(&config, &config.program_name, program_name);
+    if (PyStatus_Exception(status))
+	goto fail_config;
+
+    argv[0] = program_name;
+    status = PyConfig_SetArgv(&config, 1, argv);
+    if (PyStatus_Exception(status))
+	goto fail_config;
+
+    if (profile.path) {
+	config.module_search_paths_set = 1;
+	for (p = profile.path; *p; p++) {
+	    size_t size;
+	    wchar_t *path = get_wide_string(unmeta(*p), &size);
+
+	    status = PyWideStringList_Append(&config.module_search_paths, path);
+	    zfree(path, size);
+	    if (PyStatus_Exception(status))
+		goto fail_config;
+	}
+    }
+
+    status = Py_InitializeFromConfig(&config);
+    PyConfig_Clear(&config);
+    if (PyStatus_Exception(status))
+	goto fail;
+
+    return 0;
+
+fail_config:
+    PyConfig_Clear(&config);
+fail:
+    zwarn("failed to initialize Python: %s",
+	    status.err_msg ? status.err_msg : "unknown error");
+    return 1;
+}
+#else
+static int
+init_interpreter(void)
+{
+    struct init_profile profile;
 #if PY_MAJOR_VERSION >= 3
-    size_t zsh_name_size = strlen(argzero);
-    wchar_t *zsh_name_wchar;
-    wchar_t *argv[2];
-    wchar_t *program_name;
-    if ((zsh_name_wchar = zhalloc(zsh_name_size + 1)) == NULL)
-	return 1;
-    mbstowcs(zsh_name_wchar, argzero, zsh_name_size);
-    zsh_name_wchar[zsh_name_size] = '\0';
-    program_name = zsh_name_wchar;
+    wchar_t *argv[1];
 #else
-    char *argv[2];
+    char *argv[1];
     char *program_name = argzero;
 #endif
+
+    get_init_profile(&profile);
+
+#if PY_MAJOR_VERSION >= 3
+    if (!program_name)
+	program_name = get_wide_string(argzero, &program_name_size);
+#endif
+
+    if (profile.isolated) {
+	Py_IgnoreEnvironmentFlag = 1;
+	Py_NoUserSiteDirectory = 1;
+#if PY_VERSION_HEX >= 0x03040000
+	Py_IsolatedFlag = 1;
+#endif
+    }
+    if (profile.no_site)
+	Py_NoSiteFlag = 1;
+    if (profile.no_bytecode)
+	Py_DontWriteBytecodeFlag = 1;
+
+#if PY_VERSION_HEX >= 0x03020000
+    if (profile.path) {
+	char *joined = sepjoin(profile.path, ":", 0);
+	size_t size;
+	wchar_t *path = get_wide_string(unmeta(joined), &size);
+
+	Py_SetPath(path);
+	zfree(path, size);
+    }
+#endif
+
     argv[0] = program_name;
-    argv[1] = NULL;
     Py_SetProgramName(program_name);
+    Py_InitializeEx(0);
+    PySys_SetArgvEx(1, argv, 0);
+
+#if PY_MAJOR_VERSION < 3
+    if (profile.path)
+	PySys_SetPath(unmeta(sepjoin(profile.path, ":", 0)));
+#endif
+
+    return 0;
+}
+#endif
+
+/* Initializes interpreter. Called from boot_ or, if "lazy" is present in 
+ * $ZPYTHON_OPTIONS, on first use. */
+static int
+init_python(void)
+{
+    char *cache_file, **preload;
+    double start = get_time();
+
     zpython_subshell = zsh_subshell;
-    if (PyImport_AppendInittab("zsh", PyInit_zsh) == -1)
+    main_thread = pthread_self();
+    if (init_interpreter())
 	return 1;
-    Py_InitializeEx(0);
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
     PYTHON_INIT(1);
-    PySys_SetArgvEx(1, argv, 0);
     if (!(globals = PyModule_GetDict(PyImport_AddModule("__main__"))))
 	return 1;
+    if (codecache_init(get_boot_size("ZPYTHON_CODE_CACHE_SIZE",
+		    CODECACHE_DEFAULT_CAPACITY)))
+	return 1;
+    if ((cache_file = getsparam("ZPYTHON_CODE_CACHE_FILE")) && *cache_file) {
+	codecache_file = ztrdup(unmeta(cache_file));
+	codecache_owner = getpid();
+	codecache_load(codecache_file);
+	addhookfunc("exit", codecache_exit_hook);
+    }
+    if (has_boot_option("native-io") && install_native_io())
+	return 1;
+    init_time = get_time() - start;
+    if ((preload = get_boot_words("ZPYTHON_PRELOAD")) && *preload
+	    && start_preload(preload))
+	PyErr_PrintEx(0);
     PYTHON_FINISH;
+    release_main_gil();
     return 0;
 }
 
+/**/
+int
+boot_(UNUSED(Module m))
+{
+    if (PyImport_AppendInittab("zsh", PyInit_zsh) == -1)
+	return 1;
+    lazy_boot = has_boot_option("lazy");
+    if (lazy_boot)
+	return 0;
+    return init_python();
+}
+
 /**/
 int
 cleanup_(Module m)
 {
     if (Py_IsInitialized()) {
 	struct specialparam *cur_sp = first_assigned_param;
-
+	struct hook_kind *hk;
+
+	if (zsh_subshell > zpython_subshell)
+	    after_fork();
+	/* GIL is kept until Py_Finalize */
+	PyGILState_Ensure();
+	if (preload_thread)
+	    wait_preload();
 	while (cur_sp) {
 	    char *name = cur_sp->name;
 	    Param pm = (Param) paramtab->getnode(paramtab, name);
@@ -1975,9 +8158,55 @@ cleanup_(Module m)
 	     * sp->next */
 	    cur_sp = next_sp;
 	}
-	PYTHON_RESTORE_THREAD;
+	if (codecache_file) {
+	    if (getpid() == codecache_owner && codecache_save(codecache_file))
+		PyErr_PrintEx(0);
+	    deletehookfunc("exit", codecache_exit_hook);
+	    zsfree(codecache_file);
+	    codecache_file = NULL;
+	}
+	codecache_destroy();
+	remove_widgets();
+	clear_highlight_cache();
+	if (hl_styles) {
+	    freearray(hl_styles);
+	    hl_styles = NULL;
+	}
+	for (hk = hook_kinds; hk->name; hk++) {
+	    remove_hook_shim(hk);
+	    prune_hooks(hk, 1);
+	}
+	while (python_builtins) {
+	    struct python_builtin *pb = python_builtins;
+
+	    python_builtins = pb->next;
+	    free_python_builtin(pb);
+	}
+	stop_refresh_worker();
+#if PY_VERSION_HEX >= 0x03040000
+	stop_event_loop();
+#endif
+	remove_prompt_hook();
+	while (first_filecode)
+	    free_filecode(first_filecode);
+	Py_CLEAR(preload_info);
+	Py_CLEAR(glob_dir_cache);
+	preload_wait = 0.0;
+	Py_CLEAR(native_stdout);
+	Py_CLEAR(native_stderr);
+#if PY_MAJOR_VERSION >= 3
+	Py_CLEAR(sys_dict);
+	Py_CLEAR(stdout_key);
+	Py_CLEAR(stderr_key);
+#endif
 	Py_Finalize();
-	pygilstate = PyGILState_UNLOCKED;
+	main_tstate = NULL;
+	main_depth = 0;
+	main_released = 0;
+#if PY_MAJOR_VERSION >= 3
+	zfree(program_name, program_name_size);
+	program_name = NULL;
+#endif
     }
     return setfeatureenables(m, &module_features, NULL);
 }